@@ -0,0 +1,112 @@
+/**
+ * Microbenchmark for global delay bookkeeping as the thread count grows. Each thread
+ * repeats the work add_delays() does on every sample batch and blocking call: read the
+ * global delay, skip ahead if behind, and every few rounds credit itself a delay and
+ * raise the global delay. Compares a single shared atomic counter, as coz used before,
+ * with the sharded delay_counter, from 1 to 128 threads.
+ *
+ * Usage: delay_scaling [max threads] [rounds per thread]
+ */
+
+#include "delay_counter.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+enum {
+  CreditInterval = 16,  //< Rounds between delays credited to each thread
+  DelaySize = 1000
+};
+
+static size_t rounds;
+static pthread_barrier_t start_barrier;
+
+/// The single counter, padded so it does not share a line with other data
+struct alignas(64) single_counter {
+  atomic<size_t> value{0};
+};
+
+static single_counter single;
+static delay_counter* sharded;
+
+static void* single_thread(void*) {
+  pthread_barrier_wait(&start_barrier);
+  size_t local = 0;
+  for(size_t i = 0; i < rounds; i++) {
+    if(i % CreditInterval == 0) local += DelaySize;
+
+    size_t global = single.value.load();
+    if(local > global) {
+      single.value.fetch_add(local - global);
+    } else if(local < global) {
+      local = global;
+    }
+  }
+  return nullptr;
+}
+
+static void* sharded_thread(void* arg) {
+  size_t shard = reinterpret_cast<size_t>(arg);
+  pthread_barrier_wait(&start_barrier);
+  size_t local = 0;
+  for(size_t i = 0; i < rounds; i++) {
+    if(i % CreditInterval == 0) local += DelaySize;
+
+    size_t global = sharded->load();
+    if(local > global) {
+      sharded->raise_to(shard, local);
+    } else if(local < global) {
+      local = global;
+    }
+  }
+  return nullptr;
+}
+
+/// Run one configuration and return the rounds completed per second, across all threads
+static double run(size_t num_threads, void* (*fn)(void*)) {
+  vector<pthread_t> threads(num_threads);
+  pthread_barrier_init(&start_barrier, nullptr, num_threads + 1);
+  for(size_t i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], nullptr, fn, reinterpret_cast<void*>(i));
+  }
+
+  auto start = chrono::steady_clock::now();
+  pthread_barrier_wait(&start_barrier);
+  for(size_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  pthread_barrier_destroy(&start_barrier);
+  return num_threads * rounds / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+  size_t max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 128;
+  rounds = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%ld online CPUs, %zu rounds per thread\n", cpus, rounds);
+  printf("%8s %16s %16s %8s\n", "threads", "single (Mops/s)", "sharded (Mops/s)", "ratio");
+
+  for(size_t n = 1; n <= max_threads; n *= 2) {
+    single.value.store(0);
+    delay_counter counter;
+    counter.set_shards(cpus > 0 ? cpus : 1);
+    sharded = &counter;
+
+    double single_rate = run(n, single_thread);
+    double sharded_rate = run(n, sharded_thread);
+    printf("%8zu %16.1f %16.1f %8.2f\n", n, single_rate / 1e6, sharded_rate / 1e6,
+           sharded_rate / single_rate);
+  }
+  return 0;
+}
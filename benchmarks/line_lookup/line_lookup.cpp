@@ -0,0 +1,83 @@
+/**
+ * Microbenchmark for address-to-line lookups, the operation libcoz performs for
+ * the IP and every callchain frame of every sample. Compares the flat range table
+ * used by memory_map::find_line against the std::map the ranges are built in.
+ *
+ * Usage: line_lookup [ranges] [lookups]
+ */
+
+#include "inspect.h"
+#include "range_table.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+template<typename F>
+static double lookups_per_second(const vector<uintptr_t>& addrs, F find, size_t& hits) {
+  auto start = chrono::steady_clock::now();
+  hits = 0;
+  for(uintptr_t a : addrs) {
+    if(find(a)) hits++;
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return addrs.size() / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+  size_t num_ranges = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t num_lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000000;
+
+  mt19937_64 rng(1);
+
+  // Lay out line-table-sized ranges with occasional gaps, like a large binary
+  file f("/bench/source.cpp");
+  deque<line> lines;
+  map<interval, line*> ranges;
+  range_table<line> table;
+  table.reserve(num_ranges);
+
+  uintptr_t p = 0x400000;
+  for(size_t i = 0; i < num_ranges; i++) {
+    if(rng() % 8 == 0) p += 1 + rng() % 32;
+    uintptr_t len = 1 + rng() % 24;
+    lines.emplace_back(&f, i);
+    line* l = &lines.back();
+    ranges.emplace(interval(p, p + len), l);
+    table.add(p, p + len, l);
+    p += len;
+  }
+  table.freeze();
+
+  // Sample addresses uniformly over the mapped span, plus a few outside it
+  uniform_int_distribution<uintptr_t> dist(0x400000 - 0x1000, p + 0x1000);
+  vector<uintptr_t> addrs(num_lookups);
+  for(uintptr_t& a : addrs) a = dist(rng);
+
+  size_t map_hits, table_hits;
+  double map_rate = lookups_per_second(addrs, [&](uintptr_t a) {
+    auto iter = ranges.find(interval(a));
+    return iter != ranges.end() ? iter->second : nullptr;
+  }, map_hits);
+  double table_rate = lookups_per_second(addrs, [&](uintptr_t a) {
+    return table.find(a);
+  }, table_hits);
+
+  printf("ranges:       %zu\n", num_ranges);
+  printf("lookups:      %zu\n", num_lookups);
+  printf("std::map:     %.1f M lookups/sec (%zu hits)\n", map_rate / 1e6, map_hits);
+  printf("range_table:  %.1f M lookups/sec (%zu hits)\n", table_rate / 1e6, table_hits);
+  printf("speedup:      %.2fx\n", table_rate / map_rate);
+
+  if(map_hits != table_hits) {
+    fprintf(stderr, "error: lookup results differ\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * Scaling benchmark for programs with many live threads. Starts all threads, waits
+ * until every one is running, then has each do a fixed amount of work with progress
+ * points before they all exit. Coz samples and delays every registered thread, so
+ * this exercises thread registration, lookups and whole-registry scans at a scale
+ * the old fixed-size thread map could not hold. Reports the time to start the
+ * threads and the time for them to finish their work.
+ *
+ * Usage: live_threads [threads] [iterations per thread]
+ */
+
+#include <coz.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+enum {
+  StackSize = 64 * 1024   //< Small stacks, so tens of thousands of threads fit in memory
+};
+
+static pthread_barrier_t start_barrier;
+static size_t iterations;
+
+static void* task(void*) {
+  pthread_barrier_wait(&start_barrier);
+
+  volatile unsigned long sum = 0;
+  for(size_t i = 0; i < iterations; i++) {
+    for(unsigned long j = 0; j < 10000; j++) {
+      sum += j;
+    }
+    COZ_PROGRESS;
+  }
+  return nullptr;
+}
+
+int main(int argc, char** argv) {
+  size_t num_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  iterations = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20;
+  if(num_threads == 0) num_threads = 1;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, StackSize);
+
+  // The main thread releases the barrier once every thread has been created
+  pthread_barrier_init(&start_barrier, nullptr, num_threads + 1);
+
+  std::vector<pthread_t> threads(num_threads);
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < num_threads; i++) {
+    if(pthread_create(&threads[i], &attr, task, nullptr) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  auto created = std::chrono::steady_clock::now();
+
+  pthread_barrier_wait(&start_barrier);
+  for(size_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  auto finished = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double> create_time = created - start;
+  std::chrono::duration<double> run_time = finished - created;
+  printf("%zu live threads: started in %.3f s (%.1f us per thread), ran %zu iterations each in %.3f s\n",
+         num_threads, create_time.count(), create_time.count() * 1e6 / num_threads,
+         iterations, run_time.count());
+
+  pthread_barrier_destroy(&start_barrier);
+  pthread_attr_destroy(&attr);
+  return 0;
+}
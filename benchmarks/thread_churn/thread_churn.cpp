@@ -0,0 +1,55 @@
+/**
+ * Microbenchmark for thread creation and exit, which coz intercepts to start and
+ * stop sampling in every thread. Repeatedly creates a batch of short-lived threads
+ * and joins them, then reports how many threads were created and joined per second.
+ * Run it directly and under `coz run` (the run_thread_churn target) to compare.
+ *
+ * Usage: thread_churn [threads] [batch size]
+ */
+
+#include <coz.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static void* task(void*) {
+  // A little work, so each thread does something before it exits
+  volatile unsigned long sum = 0;
+  for(unsigned long i = 0; i < 1000; i++) {
+    sum += i;
+  }
+  COZ_PROGRESS;
+  return nullptr;
+}
+
+int main(int argc, char** argv) {
+  size_t num_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 20000;
+  size_t batch_size = argc > 2 ? strtoul(argv[2], nullptr, 10) : 16;
+  if(batch_size == 0) batch_size = 1;
+
+  std::vector<pthread_t> threads(batch_size);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t created = 0;
+  while(created < num_threads) {
+    size_t n = 0;
+    for(; n < batch_size && created < num_threads; n++, created++) {
+      if(pthread_create(&threads[n], nullptr, task, nullptr) != 0) {
+        perror("pthread_create");
+        return 1;
+      }
+    }
+    for(size_t i = 0; i < n; i++) {
+      pthread_join(threads[i], nullptr);
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  printf("%zu threads in batches of %zu: %.3f s, %.0f threads/s, %.1f us per thread\n",
+         num_threads, batch_size, elapsed.count(), num_threads / elapsed.count(),
+         elapsed.count() * 1e6 / num_threads);
+  return 0;
+}
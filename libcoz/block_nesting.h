@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_BLOCK_NESTING_H)
+#define CAUSAL_RUNTIME_BLOCK_NESTING_H
+
+#include <cstddef>
+
+/**
+ * Tracks a thread's possibly blocking calls. Wrapped calls can nest, such as an OpenMP
+ * barrier wait whose runtime sleeps in pthread_cond_wait or a raw futex wait, so only
+ * the outermost call records the global delay and settles the delays added while the
+ * thread was blocked. Used only by the thread that owns it.
+ */
+class block_nesting {
+public:
+  /// Start a possibly blocking call when the global delay is global. Returns true if
+  /// this is the outermost call.
+  bool enter(size_t global) {
+    if(_depth++ > 0) return false;
+    _start = global;
+    return true;
+  }
+
+  /// End a blocking call when the global delay is global. Returns true if this ends the
+  /// outermost call, and sets added to the delays inserted since it started. A call
+  /// with no matching enter() is treated as outermost.
+  bool leave(size_t global, size_t& added) {
+    if(_depth > 1) {
+      _depth--;
+      return false;
+    }
+    _depth = 0;
+    added = global - _start;
+    return true;
+  }
+
+  /// Get the number of calls that have started and not ended
+  size_t depth() const { return _depth; }
+
+private:
+  size_t _depth = 0;    //< Calls that have started and not ended
+  size_t _start = 0;    //< The global delay when the outermost call started
+};
+
+#endif
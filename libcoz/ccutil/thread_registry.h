@@ -0,0 +1,254 @@
+#if !defined(CCUTIL_THREAD_REGISTRY_H)
+#define CCUTIL_THREAD_REGISTRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+#include "log.h"
+
+/**
+ * A lock-free map from thread IDs to per-thread values that grows as threads are
+ * added. Values live in slots that are allocated in chunks of doubling size and
+ * never freed or moved, so a pointer returned by insert() or find() stays valid
+ * for the life of the process, even after its key is removed and the slot reused.
+ *
+ * Keys are looked up in a three-level radix table indexed by the key's bits, so
+ * find() costs three loads no matter how densely the keys cluster. Removed slots
+ * go on a free list, and for_each() visits only slots below the high-water mark,
+ * so iteration costs scale with the peak number of live threads.
+ *
+ * Keys must be integers of at most 32 bits; NullKey marks an unused slot.
+ */
+template<typename K, typename V, K NullKey=0>
+class thread_registry {
+  static_assert(std::is_integral<K>::value && sizeof(K) <= sizeof(uint32_t),
+                "thread_registry keys must be integers of at most 32 bits");
+public:
+  enum {
+    FirstChunkSize = 64,  //< Slots in the first chunk; each later chunk is twice as large
+    MaxChunks = 24,       //< Maximum number of chunks, for about a billion slots
+    TopBits = 8,          //< Key bits that index the top level of the radix table
+    MidBits = 12,         //< Key bits that index the middle level
+    LeafBits = 12         //< Key bits that index a leaf
+  };
+
+  thread_registry() {
+    for(size_t i = 0; i < MaxChunks; i++) {
+      _chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+    for(size_t i = 0; i < (1 << TopBits); i++) {
+      _index[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~thread_registry() {
+    for(size_t i = 0; i < MaxChunks; i++) {
+      delete[] _chunks[i].load();
+    }
+    for(size_t i = 0; i < (1 << TopBits); i++) {
+      mid_table* m = _index[i].load();
+      if(m != nullptr) {
+        for(size_t j = 0; j < (1 << MidBits); j++) {
+          delete m->entries[j].load();
+        }
+        delete m;
+      }
+    }
+  }
+
+  /// Claim a slot for a key. Returns null if the registry is full or out of memory.
+  V* insert(K key) {
+    size_t slot;
+    entry* e = claim_slot(slot);
+    if(e == nullptr) {
+      WARNING << "Thread registry is full!";
+      return nullptr;
+    }
+
+    std::atomic<uint32_t>* ref = get_index(key, true);
+    if(ref == nullptr) {
+      release_slot(slot, e);
+      WARNING << "Unable to grow the thread registry index";
+      return nullptr;
+    }
+
+    e->_tag.store(key);
+    uint32_t previous = ref->exchange(static_cast<uint32_t>(slot + 1));
+    if(previous != 0) {
+      // The key was reused without being removed, so its old slot can never be found again
+      entry* old = get_entry(previous - 1);
+      K expected = key;
+      if(old != nullptr && old->_tag.compare_exchange_strong(expected, NullKey)) {
+        release_slot(previous - 1, old);
+      }
+    }
+    return &e->_value;
+  }
+
+  /// Find the value for a key, or return null if the key is not registered
+  V* find(K key) {
+    std::atomic<uint32_t>* ref = get_index(key, false);
+    if(ref == nullptr) return nullptr;
+
+    uint32_t slot = ref->load();
+    if(slot == 0) return nullptr;
+
+    entry* e = get_entry(slot - 1);
+    // The slot may have been reused for another key since the index was read
+    if(e == nullptr || e->_tag.load() != key) return nullptr;
+    return &e->_value;
+  }
+
+  /// Remove a key and return its slot to the free list
+  void remove(K key) {
+    std::atomic<uint32_t>* ref = get_index(key, false);
+    if(ref == nullptr) return;
+
+    uint32_t slot = ref->load();
+    if(slot == 0) return;
+
+    entry* e = get_entry(slot - 1);
+    if(e == nullptr || e->_tag.load() != key) return;
+
+    // Only one remover can clear the index entry, and only that one frees the slot
+    if(!ref->compare_exchange_strong(slot, 0)) return;
+    e->_tag.store(NullKey);
+    release_slot(slot - 1, e);
+  }
+
+  /// Iterate through all registered keys and call the provided function
+  template<typename F>
+  void for_each(F fn) {
+    size_t limit = _high_water.load();
+    size_t chunk_start = 0;
+    for(size_t c = 0; c < MaxChunks && chunk_start < limit; c++) {
+      size_t chunk_size = static_cast<size_t>(FirstChunkSize) << c;
+      entry* chunk = _chunks[c].load();
+      if(chunk != nullptr) {
+        size_t n = limit - chunk_start < chunk_size ? limit - chunk_start : chunk_size;
+        for(size_t i = 0; i < n; i++) {
+          K key = chunk[i]._tag.load();
+          if(key != NullKey) {
+            fn(key, &chunk[i]._value);
+          }
+        }
+      }
+      chunk_start += chunk_size;
+    }
+  }
+
+private:
+  struct entry {
+    std::atomic<K> _tag{NullKey};
+    std::atomic<uint32_t> _next_free{0};  //< Next free slot plus one, while on the free list
+    V _value;
+  };
+
+  /// Find the chunk that holds a slot and the slot's offset in it
+  static inline size_t chunk_for(size_t slot, size_t& offset) {
+    // Chunk c starts at slot FirstChunkSize * (2^c - 1)
+    size_t scaled = slot / FirstChunkSize + 1;
+    size_t c = sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(scaled);
+    offset = slot - FirstChunkSize * ((static_cast<size_t>(1) << c) - 1);
+    return c;
+  }
+
+  entry* get_entry(size_t slot) {
+    size_t offset;
+    size_t c = chunk_for(slot, offset);
+    if(c >= MaxChunks) return nullptr;
+    entry* chunk = _chunks[c].load();
+    return chunk == nullptr ? nullptr : &chunk[offset];
+  }
+
+  /// Take a slot from the free list, or a new slot above the high-water mark
+  entry* claim_slot(size_t& slot) {
+    uint64_t head = _free_head.load();
+    while(static_cast<uint32_t>(head) != 0) {
+      size_t index = static_cast<uint32_t>(head) - 1;
+      entry* e = get_entry(index);
+      // The counter in the high half keeps a stale head from winning after a pop and push
+      uint64_t next = ((head >> 32) + 1) << 32 | e->_next_free.load();
+      if(_free_head.compare_exchange_weak(head, next)) {
+        slot = index;
+        return e;
+      }
+    }
+
+    slot = _high_water.fetch_add(1);
+    size_t offset;
+    size_t c = chunk_for(slot, offset);
+    if(c >= MaxChunks) return nullptr;
+
+    entry* chunk = _chunks[c].load();
+    if(chunk == nullptr) {
+      entry* fresh = new(std::nothrow) entry[static_cast<size_t>(FirstChunkSize) << c];
+      if(fresh == nullptr) return nullptr;
+      if(_chunks[c].compare_exchange_strong(chunk, fresh)) {
+        chunk = fresh;
+      } else {
+        // Another thread allocated this chunk first
+        delete[] fresh;
+      }
+    }
+    return &chunk[offset];
+  }
+
+  /// Push a slot onto the free list
+  void release_slot(size_t slot, entry* e) {
+    uint64_t head = _free_head.load();
+    uint64_t next;
+    do {
+      e->_next_free.store(static_cast<uint32_t>(head));
+      next = ((head >> 32) + 1) << 32 | static_cast<uint32_t>(slot + 1);
+    } while(!_free_head.compare_exchange_weak(head, next));
+  }
+
+  /// Get the index entry for a key, allocating radix table levels if requested
+  std::atomic<uint32_t>* get_index(K key, bool create) {
+    uint32_t k = static_cast<uint32_t>(key);
+    size_t top = k >> (MidBits + LeafBits);
+    size_t mid = (k >> LeafBits) & ((1 << MidBits) - 1);
+    size_t leaf = k & ((1 << LeafBits) - 1);
+
+    mid_table* m = get_level(_index[top], create);
+    if(m == nullptr) return nullptr;
+    leaf_table* l = get_level(m->entries[mid], create);
+    if(l == nullptr) return nullptr;
+    return &l->entries[leaf];
+  }
+
+  /// Load a radix table level, or allocate and publish it if it is missing
+  template<typename T>
+  static T* get_level(std::atomic<T*>& ref, bool create) {
+    T* table = ref.load();
+    if(table == nullptr && create) {
+      T* fresh = new(std::nothrow) T();
+      if(fresh == nullptr) return nullptr;
+      if(ref.compare_exchange_strong(table, fresh)) {
+        table = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    return table;
+  }
+
+  struct leaf_table {
+    std::atomic<uint32_t> entries[1 << LeafBits] = {};  //< Slot plus one for each key, or 0
+  };
+
+  struct mid_table {
+    std::atomic<leaf_table*> entries[1 << MidBits] = {};
+  };
+
+  std::atomic<entry*> _chunks[MaxChunks];           //< Slot storage, allocated on demand
+  std::atomic<size_t> _high_water{0};               //< Number of slots ever claimed
+  std::atomic<uint64_t> _free_head{0};              //< ABA counter and free slot plus one
+  std::atomic<mid_table*> _index[1 << TopBits];     //< Radix table from keys to slots
+};
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_COORDINATOR_H)
+#define CAUSAL_RUNTIME_COORDINATOR_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "coz.h"
+
+#include "delay_counter.h"
+
+#include "ccutil/log.h"
+
+/**
+ * Experiment state shared by cooperating processes through a named shared memory
+ * segment, so a virtual speedup in one process delays all of them. One attached
+ * process at a time is the coordinator: it picks each experiment's line and delay
+ * size, and the others mirror them. All processes add delays to one global delay
+ * counter, and progress points with the same name count into one set of counters,
+ * so the coordinator measures every process's progress.
+ *
+ * Every field is valid when zero, so the first process to map the segment does
+ * not need to initialize it. Line names are passed as text ("file:line"), since
+ * each process has its own line objects, and are read and written under sequence
+ * counters so a reader never sees a half-written name.
+ */
+class coordinator {
+public:
+  enum {
+    MaxPoints = 256,      //< Progress points shared by all processes
+    MaxName = 256,        //< Longest line or progress point name, including the terminator
+    LayoutVersion = 1     //< Changes whenever the segment layout does
+  };
+
+  enum point_kind {
+    ThroughputPoint = 1,
+    LatencyPoint = 2
+  };
+
+  coordinator() {}
+
+  /// Map the segment with the given name, creating it if needed. Returns false on failure.
+  bool attach(const std::string& name) {
+    _name = name[0] == '/' ? name : "/" + name;
+
+    int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) {
+      WARNING << "Unable to open shared segment " << _name << ": " << strerror(errno);
+      return false;
+    }
+
+    // Extending the segment to its size zero-fills it, and is harmless if another process did
+    struct stat st;
+    if(fstat(fd, &st) == -1 ||
+       (static_cast<size_t>(st.st_size) < sizeof(segment) && ftruncate(fd, sizeof(segment)) == -1)) {
+      WARNING << "Unable to size shared segment " << _name << ": " << strerror(errno);
+      close(fd);
+      return false;
+    }
+
+    void* p = mmap(nullptr, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+      WARNING << "Unable to map shared segment " << _name << ": " << strerror(errno);
+      return false;
+    }
+
+    segment* s = static_cast<segment*>(p);
+    uint32_t layout = 0;
+    if(!s->layout.compare_exchange_strong(layout, LayoutVersion) && layout != LayoutVersion) {
+      WARNING << "Shared segment " << _name << " was made by a different version of coz";
+      munmap(p, sizeof(segment));
+      return false;
+    }
+
+    s->attached.fetch_add(1);
+    _segment = s;
+    return true;
+  }
+
+  /// Count a forked child as attached. It shares its parent's mapping.
+  void attach_child() {
+    if(_segment != nullptr) _segment->attached.fetch_add(1);
+  }
+
+  /**
+   * Stop counting this process as attached, and remove the segment's name if it was
+   * the last. The mapping stays, since this process's threads may still pay delays.
+   */
+  void detach() {
+    if(_segment != nullptr && _segment->attached.fetch_sub(1) == 1) {
+      shm_unlink(_name.c_str());
+    }
+  }
+
+  /// Check if this process shares experiments with others
+  inline bool is_attached() const { return _segment != nullptr; }
+
+  /// Get the global delay counter all attached processes share
+  delay_counter& get_global_delay() { return _segment->global_delay; }
+
+  /**
+   * Become the coordinator if there is none, or if the coordinator has exited without
+   * resigning. Returns true if this process is the coordinator.
+   */
+  bool try_coordinate(pid_t pid) {
+    pid_t current = _segment->coordinator.load();
+    if(current == pid) return true;
+    if(current != 0 && (kill(current, 0) == 0 || errno != ESRCH)) return false;
+
+    if(_segment->coordinator.compare_exchange_strong(current, pid)) {
+      // An experiment the old coordinator left running never ends on its own
+      _segment->active.store(false);
+      return true;
+    }
+    return false;
+  }
+
+  /// Give up coordination, ending any running experiment
+  void resign(pid_t pid) {
+    if(_segment->coordinator.load() == pid) {
+      _segment->active.store(false);
+      _segment->coordinator.store(0);
+    }
+  }
+
+  /// Start an experiment in every attached process
+  void begin_experiment(const std::string& line, size_t delay_size) {
+    uint64_t seq = _segment->experiment_seq.load();
+    _segment->experiment_seq.store(seq | 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    write_name(_segment->selected, line);
+    _segment->delay_size.store(delay_size, std::memory_order_relaxed);
+    _segment->experiment_seq.store((seq | 1) + 1, std::memory_order_release);
+    _segment->active.store(true);
+  }
+
+  /// End the running experiment in every attached process
+  void end_experiment() {
+    _segment->active.store(false);
+  }
+
+  /**
+   * Get the running experiment's line and delay size, and an ID that changes with each
+   * experiment. Returns false if no experiment is running.
+   */
+  bool get_experiment(uint64_t& id, std::string& line, size_t& delay_size) const {
+    if(!_segment->active.load()) return false;
+    for(size_t spins = 0; spins < ClaimSpinLimit; spins++) {
+      id = _segment->experiment_seq.load(std::memory_order_acquire);
+      if(id & 1) continue;
+      read_name(_segment->selected, line);
+      delay_size = _segment->delay_size.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(_segment->experiment_seq.load(std::memory_order_relaxed) == id) return true;
+    }
+    // The coordinator stopped while writing; a new one will start the next experiment
+    return false;
+  }
+
+  /// Offer a line for a coming experiment. A later offer from any process replaces it.
+  void propose_line(const std::string& line) {
+    uint64_t seq = _segment->proposal_seq.load();
+    // Another process is writing its offer, which is as good as this one
+    if((seq & 1) || !_segment->proposal_seq.compare_exchange_strong(seq, seq + 1)) return;
+    std::atomic_thread_fence(std::memory_order_release);
+    write_name(_segment->proposal, line);
+    _segment->proposal_seq.store(seq + 2, std::memory_order_release);
+  }
+
+  /// Take the most recently offered line, if one was offered since the last call
+  bool take_proposal(std::string& line) {
+    for(size_t spins = 0; spins < ClaimSpinLimit; spins++) {
+      uint64_t seq = _segment->proposal_seq.load(std::memory_order_acquire);
+      if(seq == _taken_proposal) return false;
+      if(seq & 1) continue;
+      read_name(_segment->proposal, line);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(_segment->proposal_seq.load(std::memory_order_relaxed) == seq) {
+        _taken_proposal = seq;
+        return true;
+      }
+    }
+    // A process stopped while writing its offer
+    return false;
+  }
+
+  /// Count a sample in the selected line, from any process
+  inline void count_selected_sample() {
+    if(_segment != nullptr) _segment->selected_samples.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Get the number of samples in selected lines, from every process
+  size_t get_selected_samples() const {
+    return _segment->selected_samples.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Get the shared counters for a progress point, registering it if no process has.
+   * Throughput points use one counter, and latency points two (begin, then end).
+   * Returns null if the point table is full or the name is too long.
+   */
+  coz_counter_t* get_counters(point_kind kind, const std::string& name) {
+    if(name.size() >= MaxName) return nullptr;
+
+    point* found = find_point(kind, name, MaxPoints);
+    if(found != nullptr) return found->counters;
+
+    // Claim an empty slot and fill it in
+    for(size_t i = 0; i < MaxPoints; i++) {
+      point& p = _segment->points[i];
+      uint32_t state = PointEmpty;
+      if(p.state.load() == PointEmpty && p.state.compare_exchange_strong(state, PointClaimed)) {
+        p.kind = kind;
+        memcpy(p.name, name.c_str(), name.size() + 1);
+        p.state.store(PointReady);
+
+        // Another process may have registered the same name at the same time. Every
+        // process uses the first slot with the name, and leaves the others unused.
+        point* first = find_point(kind, name, i);
+        if(first != nullptr) {
+          p.state.store(PointAbandoned);
+          return first->counters;
+        }
+        return p.counters;
+      }
+    }
+
+    WARNING << "Too many shared progress points; " << name << " counts only in this process";
+    return nullptr;
+  }
+
+  /// Call fn(kind, name) for every shared progress point
+  template<typename F>
+  void for_each_point(F fn) const {
+    for(size_t i = 0; i < MaxPoints; i++) {
+      const point& p = _segment->points[i];
+      uint32_t state = p.state.load();
+      if(state == PointEmpty) return;
+      if(state == PointReady) {
+        fn(static_cast<point_kind>(p.kind), std::string(p.name));
+      }
+    }
+  }
+
+private:
+  enum {
+    PointEmpty = 0,
+    PointClaimed,     //< A process is filling in the slot
+    PointReady,
+    PointAbandoned,   //< Registered twice at once; the earlier slot is used instead
+    ClaimSpinLimit = 1 << 20  //< Loads before giving up on a process that stopped mid-write
+  };
+
+  struct point {
+    std::atomic<uint32_t> state;
+    uint32_t kind;
+    char name[MaxName];
+    coz_counter_t counters[2];
+  };
+
+  struct segment {
+    std::atomic<uint32_t> layout;           //< LayoutVersion, set by the first process to attach
+    std::atomic<size_t> attached;           //< Processes that have not shut down
+    std::atomic<pid_t> coordinator;         //< Process that runs experiments, or 0
+    std::atomic<bool> active;               //< Is an experiment running?
+    std::atomic<uint64_t> experiment_seq;   //< Odd while the experiment is being written
+    std::atomic<size_t> delay_size;
+    std::atomic<size_t> selected_samples;
+    char selected[MaxName];                 //< Name of the line to speed up
+    std::atomic<uint64_t> proposal_seq;     //< Odd while an offer is being written
+    char proposal[MaxName];                 //< Name of the line most recently offered
+    /// Shared by all attached processes, whose threads raise shards by index regardless of
+    /// process, so shards may be shared across processes. Every update is a single atomic
+    /// operation, so a process that dies mid-update leaves the counter usable, and every
+    /// attached process refreshes the published total while an experiment runs.
+    delay_counter global_delay;
+    point points[MaxPoints];
+  };
+
+  /// Find a ready point with a name among the first limit slots, waiting for slots
+  /// that are being filled in
+  point* find_point(point_kind kind, const std::string& name, size_t limit) {
+    for(size_t i = 0; i < limit; i++) {
+      point& p = _segment->points[i];
+      uint32_t state = p.state.load();
+      for(size_t spins = 0; state == PointClaimed && spins < ClaimSpinLimit; spins++) {
+        state = p.state.load();
+      }
+      if(state == PointEmpty) return nullptr;
+      if(state == PointReady && p.kind == static_cast<uint32_t>(kind) && name == p.name) {
+        return &p;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Copy a name into the segment a byte at a time, since readers may load it concurrently
+  static void write_name(char* dest, const std::string& name) {
+    size_t n = name.size() < MaxName - 1 ? name.size() : MaxName - 1;
+    for(size_t i = 0; i < n; i++) {
+      __atomic_store_n(&dest[i], name[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&dest[n], '\0', __ATOMIC_RELAXED);
+  }
+
+  static void read_name(const char* src, std::string& name) {
+    name.clear();
+    for(size_t i = 0; i < MaxName; i++) {
+      char c = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+      if(c == '\0') break;
+      name += c;
+    }
+  }
+
+  segment* _segment = nullptr;    //< The mapped segment, or null if not attached
+  std::string _name;              //< Name of the shared memory object
+  uint64_t _taken_proposal = 0;   //< Sequence number of the last proposal taken
+};
+
+#endif
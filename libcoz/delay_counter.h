@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_DELAY_COUNTER_H)
+#define CAUSAL_RUNTIME_DELAY_COUNTER_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * The global delay count. A thread that is ahead of the global delay raises the total
+ * to its local delay, and the total is the largest value raised. Readers load one
+ * published total, which is written only when a raise or addition moves it, so threads
+ * that are caught up only read its cache line. Raises are published before raise_to
+ * returns, so a thread that wakes another after crediting itself a delay makes the
+ * credit visible first. Each raise is also recorded in the raising thread's shard, so
+ * refresh() can publish a raise whose process died before publishing it.
+ *
+ * Every operation is a single atomic load, store, or compare-and-swap, so the counter
+ * holds no lock-like state and stays usable in shared memory if a process using it
+ * dies at any point.
+ */
+class delay_counter {
+public:
+  enum {
+    MaxShards = 64,     //< Maximum number of shards (must be a power of two)
+    CacheLineSize = 64
+  };
+
+  delay_counter() {
+    for(size_t i = 0; i < MaxShards; i++) {
+      _shards[i].value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /// Spread raises over at least n shards. The number of shards only grows, so this
+  /// may be called while the counter is in use.
+  void set_shards(size_t n) {
+    size_t count = 1;
+    while(count < n && count < MaxShards) count *= 2;
+    size_t mask = _mask.load();
+    while(count - 1 > mask && !_mask.compare_exchange_weak(mask, count - 1)) {}
+  }
+
+  /// Get the number of shards in use
+  size_t get_shards() const { return _mask.load(std::memory_order_relaxed) + 1; }
+
+  /// Get the most recently published total
+  inline size_t load() const { return _published.load(); }
+
+  /// Find the current total, including raises recorded in shards but not yet published
+  size_t load_exact() const {
+    size_t count = get_shards();
+    size_t total = _published.load();
+    for(size_t i = 0; i < count; i++) {
+      size_t value = _shards[i].value.load();
+      if(value > total) total = value;
+    }
+    return total;
+  }
+
+  /// Publish any raise left in a shard, and return the current total
+  size_t refresh() {
+    size_t total = load_exact();
+    publish(total);
+    return total;
+  }
+
+  /**
+   * Raise the total to at least target through a shard, and publish it; shard is any
+   * number, such as a thread's index. Like two threads crediting the same delay, two
+   * raises at once leave the larger target as the total.
+   */
+  inline void raise_to(size_t shard, size_t target) {
+    std::atomic<size_t>& value = _shards[shard & _mask.load(std::memory_order_relaxed)].value;
+    size_t current = value.load(std::memory_order_relaxed);
+    while(target > current && !value.compare_exchange_weak(current, target)) {}
+    publish(target);
+  }
+
+  /**
+   * Add to the current total and publish the result right away. Additions are for
+   * delays credited to no thread, and are rare, so each one finds the exact total.
+   * Concurrent additions are all counted.
+   */
+  void add(size_t amount) {
+    size_t published = _published.load();
+    size_t total;
+    do {
+      total = load_exact();
+    } while(!_published.compare_exchange_weak(published, total + amount));
+  }
+
+private:
+  /// Raise the published total to at least total
+  void publish(size_t total) {
+    size_t current = _published.load();
+    while(total > current && !_published.compare_exchange_weak(current, total)) {}
+  }
+
+  struct alignas(CacheLineSize) shard {
+    std::atomic<size_t> value;
+  };
+
+  shard _shards[MaxShards];
+  alignas(CacheLineSize) std::atomic<size_t> _published{0};  //< The total seen by readers
+  std::atomic<size_t> _mask{0};                                //< Number of shards in use, minus one
+};
+
+#endif
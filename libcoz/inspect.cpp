@@ -8,18 +8,34 @@
 #include "inspect.h"
 
 #include "lief_loader.h"
+#include "line_map_cache.h"
 
 #ifdef __APPLE__
   #include <mach-o/dyld.h>
+  #include <mach-o/loader.h>
+  #include <mach/vm_prot.h>
 #endif
+#ifndef __APPLE__
+  #include <link.h>
+  #include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <exception>
 #include <iostream>
 #include <fstream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <system_error>
@@ -30,6 +46,7 @@
 #include <algorithm>
 #include <dwarf++.hh>
 
+#include "real.h"
 #include "util.h"
 
 #include "ccutil/log.h"
@@ -37,6 +54,13 @@
 
 using namespace std;
 
+#ifdef __APPLE__
+// Original pthread functions that bypass DYLD_INTERPOSE (defined in mac_interpose.cpp)
+extern "C" int coz_orig_pthread_create(pthread_t*, const pthread_attr_t*,
+                                        void*(*)(void*), void*);
+extern "C" int coz_orig_pthread_join(pthread_t, void**);
+#endif
+
 static dwarf::value find_attribute(const dwarf::die& d, dwarf::DW_AT attr);
 
 static string absolute_path(const string filename) {
@@ -48,25 +72,28 @@ static string absolute_path(const string filename) {
   return string(cwd) + '/' + filename;
 }
 
-static string canonicalize_path(const string filename) {
-  vector<string> parts = split(absolute_path(filename), '/');
+static string canonicalize_path(const string& filename) {
+  string path = absolute_path(filename);
 
-  // Iterate over the path parts to produce a reduced list of path sections
-  vector<string> reduced;
-  for(string part : parts) {
-    if(part == "..") {
-      REQUIRE(reduced.size() > 0) << "Invalid absolute path";
-      reduced.pop_back();
-    } else if(part.length() > 0 && part != ".") {
-      // Skip single-dot or empty entries
-      reduced.push_back(part);
-    }
-  }
-
-  // Join path sections into a single string
+  // Copy path sections into the result, skipping empty and "." sections and
+  // dropping the previous section for each ".."
   string result;
-  for(string part : reduced) {
-    result += "/" + part;
+  result.reserve(path.size());
+  size_t pos = 0;
+  while(pos < path.size()) {
+    size_t end = path.find('/', pos);
+    if(end == string::npos)
+      end = path.size();
+    size_t len = end - pos;
+
+    if(len == 2 && path[pos] == '.' && path[pos + 1] == '.') {
+      REQUIRE(!result.empty()) << "Invalid absolute path";
+      result.erase(result.rfind('/'));
+    } else if(len > 0 && !(len == 1 && path[pos] == '.')) {
+      result += '/';
+      result.append(path, pos, len);
+    }
+    pos = end + 1;
   }
 
   return result;
@@ -103,24 +130,56 @@ static const string get_full_path(const string filename) {
   return "";
 }
 
+/// An executable mapping of a file into the address space
+struct loaded_segment {
+  string path;
+  uintptr_t base;
+  uintptr_t limit;
+  uintptr_t load_address;   //< Offset from the file's link-time addresses
+};
+
 #ifdef __APPLE__
-unordered_map<string, uintptr_t> get_loaded_files() {
-  unordered_map<string, uintptr_t> result;
+vector<loaded_segment> get_executable_segments() {
+  vector<loaded_segment> result;
 
   uint32_t count = _dyld_image_count();
   for(uint32_t i = 0; i < count; i++) {
     const char* name = _dyld_get_image_name(i);
-    if(name && name[0] == '/') {
-      intptr_t slide = _dyld_get_image_vmaddr_slide(i);
-      result[name] = static_cast<uintptr_t>(slide);
+    const struct mach_header* header = _dyld_get_image_header(i);
+    if(name && name[0] == '/' && header) {
+      uintptr_t slide = static_cast<uintptr_t>(_dyld_get_image_vmaddr_slide(i));
+      bool found = false;
+
+      // Walk the load commands for executable segments
+      if(header->magic == MH_MAGIC_64) {
+        const char* cmd = reinterpret_cast<const char*>(header) + sizeof(struct mach_header_64);
+        for(uint32_t c = 0; c < header->ncmds; c++) {
+          const struct load_command* lc = reinterpret_cast<const struct load_command*>(cmd);
+          if(lc->cmd == LC_SEGMENT_64) {
+            const struct segment_command_64* seg =
+              reinterpret_cast<const struct segment_command_64*>(lc);
+            if((seg->initprot & VM_PROT_EXECUTE) && seg->vmsize > 0) {
+              result.push_back(loaded_segment{name, seg->vmaddr + slide,
+                                              seg->vmaddr + slide + seg->vmsize, slide});
+              found = true;
+            }
+          }
+          cmd += lc->cmdsize;
+        }
+      }
+
+      // Without a usable segment the image can still be read eagerly
+      if(!found) {
+        result.push_back(loaded_segment{name, 0, 0, slide});
+      }
     }
   }
 
   return result;
 }
 #else
-unordered_map<string, uintptr_t> get_loaded_files() {
-  unordered_map<string, uintptr_t> result;
+vector<loaded_segment> get_executable_segments() {
+  vector<loaded_segment> result;
 
   ifstream maps("/proc/self/maps");
   while(maps.good() && !maps.eof()) {
@@ -156,7 +215,7 @@ unordered_map<string, uintptr_t> get_loaded_files() {
 
     // If this is an executable mapping of an absolute path, include it
     if(perms[2] == 'x' && path[0] == '/') {
-      result[path] = base - offset;
+      result.push_back(loaded_segment{path, base, limit, base - offset});
     }
   }
 
@@ -164,119 +223,120 @@ unordered_map<string, uintptr_t> get_loaded_files() {
 }
 #endif
 
-bool wildcard_match(string::const_iterator subject,
-                    string::const_iterator subject_end,
-                    string::const_iterator pattern,
-                    string::const_iterator pattern_end) {
+bool in_scope(const string& name, const scope_matcher& scope) {
+  return scope.matches(canonicalize_path(name));
+}
 
-  if((pattern == pattern_end) != (subject == subject_end)) {
-    // If one but not both of the iterators have finished, match failed
-    return false;
-  } else if(pattern == pattern_end && subject == subject_end) {
-    // If both iterators have finished, match succeeded
-    return true;
-
-  } else if(*pattern == '%') {
-    // Try possible matches of the wildcard, starting with the longest possible match
-    for(auto match_end = subject_end; match_end >= subject; match_end--) {
-      if(wildcard_match(match_end, subject_end, pattern+1, pattern_end)) {
-        return true;
-      }
-    }
-    // No matches found. Abort
-    return false;
+/// A source file named in debug information, with its scope decision
+struct source_file {
+  string path;      //< Canonical path
+  bool in_scope;    //< Matches the source scope and is not filtered out
+  bool is_system;   //< Under a system include or library directory
+};
 
-  } else {
-    // Walk through non-wildcard characters to match
-    while(subject != subject_end && pattern != pattern_end && *pattern != '%') {
-      // If the characters do not match, abort. Otherwise keep going.
-      if(*pattern != *subject) {
-        return false;
-      } else {
-        pattern++;
-        subject++;
-      }
+/**
+ * Canonical paths and scope decisions for the source files named in debug information.
+ * The same paths recur in every line table of a binary, so each one is canonicalized
+ * and matched against the scope once per worker. Entries never move once added.
+ */
+class source_file_cache {
+public:
+  source_file_cache(const scope_matcher& scope, bool default_scope, bool allow_system_sources) :
+      _scope(scope), _default_scope(default_scope), _allow_system_sources(allow_system_sources) {}
+
+  const source_file* get(const string& raw) {
+    auto iter = _files.find(raw);
+    if(iter != _files.end())
+      return &iter->second;
+
+    source_file f;
+    if(!raw.empty()) {
+      f.path = canonicalize_path(raw);
     }
-
-    // Recursive call to handle wildcard or termination cases
-    return wildcard_match(subject, subject_end, pattern, pattern_end);
+    f.is_system = is_system_path(f.path);
+    f.in_scope = matches_scope(f);
+    return &_files.emplace(raw, std::move(f)).first->second;
   }
-}
-
-bool wildcard_match(const string& subject, const string& pattern) {
-  return wildcard_match(subject.begin(), subject.end(), pattern.begin(), pattern.end());
-}
 
-static bool in_scope_normalized(const string& normalized,
-                                const unordered_set<string>& scope) {
-  for(const string& pattern : scope) {
-    if(wildcard_match(normalized, pattern)) {
+private:
+  bool matches_scope(const source_file& f) const {
+    if(f.path.empty())
+      return false;
+    if(is_coz_header(f.path))
+      return false;
+    if(!_allow_system_sources && f.is_system)
+      return false;
+    if(_scope.empty())
       return true;
-    }
+    // Filter Rust toolchain/dependency paths unless user specified an explicit source scope
+    if(_default_scope && is_rust_path(f.path))
+      return false;
+    return _scope.matches(f.path);
   }
-  return false;
-}
 
-bool in_scope(const string& name, const unordered_set<string>& scope) {
-  string normalized = canonicalize_path(name);
-  return in_scope_normalized(normalized, scope);
-}
+  const scope_matcher& _scope;
+  bool _default_scope;
+  bool _allow_system_sources;
+  unordered_map<string, source_file> _files;
+};
 
+/// The source files of one line table, resolved on first use by file index
+class line_table_files {
+public:
+  line_table_files(const dwarf::line_table& table, source_file_cache& cache) :
+      _table(table), _cache(cache) {}
+
+  const source_file* get(unsigned index) {
+    if(index < _files.size() && _files[index] != nullptr)
+      return _files[index];
+    // Look the entry up first, so an invalid index throws before the table grows
+    const source_file* f = _cache.get(_table.get_file(index)->path);
+    if(index >= _files.size())
+      _files.resize(index + 1, nullptr);
+    _files[index] = f;
+    return f;
+  }
 
-static bool file_matches_scope(const string& name,
-                               const unordered_set<string>& scope,
-                               bool allow_system_sources) {
-  if(name.empty())
-    return false;
-  string normalized = canonicalize_path(name);
-  if(is_coz_header(normalized))
-    return false;
-  if(!allow_system_sources && is_system_path(normalized))
-    return false;
-  if(scope.empty())
-    return true;
-  // Filter Rust toolchain/dependency paths unless user specified an explicit source scope
-  bool default_scope = (scope.size() == 1 && scope.count("%") == 1);
-  if(default_scope && is_rust_path(normalized))
-    return false;
-  return in_scope_normalized(normalized, scope);
-}
+  const dwarf::line_table& table() const { return _table; }
+
+private:
+  const dwarf::line_table& _table;
+  source_file_cache& _cache;
+  vector<const source_file*> _files;
+};
 
 static void enqueue_range(vector<memory_map::queued_range>& pending,
-                          const string& filename,
+                          const source_file* file,
                           size_t line_no,
                           interval range,
                           bool preferred = false) {
-  if(filename.empty())
+  if(file == nullptr || file->path.empty())
     return;
-  pending.push_back(memory_map::queued_range{filename, line_no, range, preferred});
+  pending.push_back(memory_map::queued_range{&file->path, line_no, range, preferred});
 }
 
 struct subprogram_range {
   uintptr_t low;
   uintptr_t high;
-  std::string filename;
+  const source_file* file;
   size_t line;
   bool in_scope;
 };
 
 static void collect_subprogram_ranges(const dwarf::die& d,
-                                      const dwarf::line_table& table,
-                                      const unordered_set<string>& source_scope,
-                                      bool allow_system_sources,
+                                      line_table_files& files,
                                       vector<subprogram_range>& ranges) {
   if(!d.valid())
     return;
 
   try {
     if(d.tag == dwarf::DW_TAG::subprogram) {
-      string decl_file;
+      const source_file* decl_file = nullptr;
       dwarf::value decl_file_val = find_attribute(d, dwarf::DW_AT::decl_file);
       if(decl_file_val.valid() &&
          decl_file_val.get_type() == dwarf::value::type::uconstant &&
-         table.valid()) {
-        decl_file = table.get_file(decl_file_val.as_uconstant())->path;
-        decl_file = canonicalize_path(decl_file);
+         files.table().valid()) {
+        decl_file = files.get(decl_file_val.as_uconstant());
       }
 
       size_t decl_line = 0;
@@ -288,8 +348,7 @@ static void collect_subprogram_ranges(const dwarf::die& d,
           decl_line = decl_line_val.as_sconstant();
       }
 
-      bool file_in_scope = decl_file.size() > 0 &&
-                           file_matches_scope(decl_file, source_scope, allow_system_sources);
+      bool file_in_scope = decl_file != nullptr && decl_file->in_scope;
 
       if(file_in_scope && decl_line > 0) {
         dwarf::value ranges_val = find_attribute(d, dwarf::DW_AT::ranges);
@@ -330,7 +389,7 @@ static void collect_subprogram_ranges(const dwarf::die& d,
   }
 
   for(const auto& child : d) {
-    collect_subprogram_ranges(child, table, source_scope, allow_system_sources, ranges);
+    collect_subprogram_ranges(child, files, ranges);
   }
 }
 
@@ -354,29 +413,480 @@ static const subprogram_range* find_subprogram(const vector<subprogram_range>& r
   return nullptr;
 }
 
+enum {
+  MaxDwarfWorkers = 16,     //< Upper bound on threads used to read debug information at startup
+  LoaderPollInterval = 50   //< Time between checks for dlopen and dlclose (ms)
+};
+
+/// Order queued ranges by address, then prefer ranges from inlined call sites
+static bool queued_range_less(const memory_map::queued_range& a,
+                              const memory_map::queued_range& b) {
+  if(a.range.get_base() != b.range.get_base())
+    return a.range.get_base() < b.range.get_base();
+  if(a.range.get_limit() != b.range.get_limit())
+    return a.range.get_limit() < b.range.get_limit();
+  if(a.preferred != b.preferred)
+    return a.preferred && !b.preferred;
+  if(a.line != b.line)
+    return a.line < b.line;
+  return *a.filename < *b.filename;
+}
+
+template<typename F>
+struct worker_arg {
+  F* fn;
+  size_t index;
+};
+
+template<typename F>
+static void* worker_main(void* p) {
+  worker_arg<F>* arg = static_cast<worker_arg<F>*>(p);
+  (*arg->fn)(arg->index);
+  return nullptr;
+}
+
+/**
+ * Run fn(0) through fn(n-1) concurrently and wait for all of them. The calling
+ * thread runs fn(0). Threads are created with the real pthread functions so they
+ * are never registered with the profiler. If a thread cannot be started, its
+ * share of the work runs on the calling thread instead.
+ */
+template<typename F>
+static void run_workers(size_t n, F fn) {
+  vector<worker_arg<F>> args(n);
+  vector<pthread_t> threads(n);
+  vector<bool> started(n, false);
+
+  for(size_t i = 1; i < n; i++) {
+    args[i] = worker_arg<F>{&fn, i};
+#ifdef __APPLE__
+    started[i] = coz_orig_pthread_create(&threads[i], nullptr, worker_main<F>, &args[i]) == 0;
+#else
+    started[i] = real::pthread_create(&threads[i], nullptr, worker_main<F>, &args[i]) == 0;
+#endif
+  }
+
+  if(n > 0)
+    fn(0);
+
+  for(size_t i = 1; i < n; i++) {
+    if(started[i]) {
+#ifdef __APPLE__
+      coz_orig_pthread_join(threads[i], nullptr);
+#else
+      real::pthread_join(threads[i], nullptr);
+#endif
+    } else {
+      fn(i);
+    }
+  }
+}
+
 void memory_map::build(const unordered_set<string>& binary_scope,
                        const unordered_set<string>& source_scope,
-                       bool allow_system_sources) {
-  auto loaded = get_loaded_files();
+                       bool allow_system_sources,
+                       const string& cache_dir,
+                       bool lazy,
+                       bool jit_maps) {
+  size_t start_time = get_time();
+  auto segments = get_executable_segments();
+
+  _binary_scope = scope_matcher(binary_scope);
+  _source_scope = scope_matcher(source_scope);
+  _default_source_scope = (source_scope.size() == 1 && source_scope.count("%") > 0);
+  _allow_system_sources = allow_system_sources;
+  _jit_maps = jit_maps;
+  _cache_dir = cache_dir;
+  if(!_cache_dir.empty()) {
+    _cache_key = line_map_cache::settings_key(source_scope, allow_system_sources);
+  }
+
+  // Collect in-scope binaries in load order
+  _loaded_objects = count_loaded_objects();
+  unordered_map<string, binary*> by_name;
+  for(const auto& seg : segments) {
+    auto iter = by_name.find(seg.path);
+    if(iter == by_name.end() && in_scope(seg.path, _binary_scope)) {
+      _binaries.emplace_back(new binary(seg.path, seg.load_address));
+      iter = by_name.emplace(seg.path, _binaries.back().get()).first;
+    }
+    if(iter != by_name.end()) {
+      iter->second->segments.push_back(interval(seg.base, seg.limit));
+    }
+  }
+
+  // Record the address ranges of binaries that will be read on demand. An image whose
+  // segments could not be found is read now instead.
+  vector<binary*> eager;
+  if(lazy) {
+    for(const auto& seg : segments) {
+      auto iter = by_name.find(seg.path);
+      if(iter != by_name.end() && seg.limit > seg.base) {
+        _lazy_segments.push_back(lazy_segment{seg.base, seg.limit, iter->second});
+      }
+    }
+    sort(_lazy_segments.begin(), _lazy_segments.end(),
+         [](const lazy_segment& a, const lazy_segment& b) { return a.base < b.base; });
+
+    for(const auto& b : _binaries) {
+      bool deferred = false;
+      for(const auto& seg : _lazy_segments) {
+        deferred |= (seg.owner == b.get());
+      }
+      if(!deferred)
+        eager.push_back(b.get());
+    }
+  } else {
+    for(const auto& b : _binaries) {
+      eager.push_back(b.get());
+    }
+  }
+
+  size_t found = load_binaries(eager);
+
+  // Start the thread that reads deferred binaries and follows dlopen and dlclose
+  start_loader_thread();
+
+  if(!_lazy_segments.empty()) {
+    VERBOSE << "Deferring debug information for " << (_binaries.size() - eager.size())
+            << " binaries until they are sampled";
+
+    REQUIRE(!_binaries.empty())
+      << "No in-scope executables or libraries were found";
+  } else if(!_jit_maps) {
+    REQUIRE(found > 0)
+      << "Debug information was not found for any in-scope executables or libraries";
+  }
+
+  VERBOSE << "Built memory map for " << eager.size() << " binaries in "
+          << (get_time() - start_time) / 1000000 << "ms";
+}
 
-  size_t in_scope_count = 0;
-  for(const auto& f : loaded) {
-    if(in_scope(f.first, binary_scope)) {
+size_t memory_map::load_binaries(const vector<binary*>& binaries) {
+  // Split the available CPUs between binaries, then between the compilation units in each one
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t cpus = online > 0 ? min(static_cast<size_t>(online), static_cast<size_t>(MaxDwarfWorkers)) : 1;
+  size_t file_workers = max<size_t>(1, min(cpus, binaries.size()));
+  size_t unit_workers = max<size_t>(1, cpus / file_workers);
+
+  struct file_result {
+    bool found = false;
+    string error;
+    debug_info info;
+  };
+  vector<file_result> results(binaries.size());
+
+  atomic<size_t> next_binary(0);
+  run_workers(file_workers, [&](size_t) {
+    for(size_t i = next_binary++; i < binaries.size(); i = next_binary++) {
+      file_result& r = results[i];
       try {
-        if(process_file(f.first, f.second, source_scope, allow_system_sources)) {
-          VERBOSE << "Including lines from executable " << f.first;
-          in_scope_count++;
-        } else {
-          VERBOSE << "Unable to locate debug information for " << f.first;
-        }
-      } catch(const system_error& e) {
-        WARNING << "Processing file \"" << f.first << "\" failed: " << e.what();
+        r.found = process_file(binaries[i]->name, unit_workers, r.info);
+      } catch(const exception& e) {
+        r.error = e.what();
+      } catch(...) {
+        r.error = "unknown error";
+      }
+    }
+  });
+
+  // Add ranges in load order so the result does not depend on thread scheduling
+  lock_guard<mutex> guard(_lock);
+  size_t found = 0;
+  for(size_t i = 0; i < binaries.size(); i++) {
+    file_result& r = results[i];
+    const string& name = binaries[i]->name;
+    if(binaries[i]->state.load() == BinaryUnloaded) {
+      // Closed with dlclose while its debug information was being read
+      continue;
+    } else if(!r.error.empty()) {
+      // The binary is not retried, so this is the only warning for it
+      WARNING << "Processing file \"" << name << "\" failed: " << r.error;
+      binaries[i]->state.store(BinaryFailed);
+      continue;
+    } else if(r.found) {
+      VERBOSE << "Including lines from executable " << name
+              << (r.info.from_cache ? " (cached, " : " (read in ")
+              << r.info.parse_time / 1000000 << "ms using "
+              << file_workers * unit_workers << " threads)";
+
+      vector<file*> files;
+      files.reserve(r.info.files.size());
+      for(const string& filename : r.info.files) {
+        VERBOSE << "Included source file " << filename;
+        files.push_back(get_file(filename).get());
+      }
+
+      // Static executables are loaded at their link-time addresses
+      uintptr_t load_address = r.info.is_static ? 0 : binaries[i]->load_address;
+      for(const auto& entry : r.info.ranges) {
+        add_range(files[entry.file], entry.line,
+                  interval(entry.base, entry.limit) + load_address);
+      }
+      found++;
+    } else {
+      VERBOSE << "Unable to locate debug information for " << name;
+    }
+    binaries[i]->state.store(BinaryLoaded);
+  }
+
+  freeze_ranges();
+  return found;
+}
+
+void memory_map::request_binary(uintptr_t addr) const {
+  // Find the last segment starting at or below addr
+  auto iter = upper_bound(_lazy_segments.begin(), _lazy_segments.end(), addr,
+                          [](uintptr_t a, const lazy_segment& s) { return a < s.base; });
+  if(iter == _lazy_segments.begin())
+    return;
+  --iter;
+  if(addr >= iter->limit)
+    return;
+
+  int expected = BinaryDeferred;
+  if(iter->owner->state.compare_exchange_strong(expected, BinaryRequested)) {
+    wake_loader();
+  }
+}
+
+void memory_map::wake_loader() const {
+  // A full pipe already has a wakeup pending
+  char c = 0;
+  ssize_t rc = write(_loader_wakeup[1], &c, 1);
+  (void)rc;
+}
+
+#ifndef __APPLE__
+static int count_objects_callback(struct dl_phdr_info* info, size_t size, void* data) {
+  // Every object reports the same totals, so stop after the first
+  if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+    *static_cast<size_t*>(data) = info->dlpi_adds + info->dlpi_subs;
+  }
+  return 1;
+}
+#endif
+
+size_t memory_map::count_loaded_objects() const {
+#ifdef __APPLE__
+  return _dyld_image_count();
+#else
+  size_t count = 0;
+  dl_iterate_phdr(count_objects_callback, &count);
+  return count;
+#endif
+}
+
+void memory_map::update_binaries() {
+  auto segments = get_executable_segments();
+
+  // Group the current executable mappings by path, keeping the first segment's load address
+  map<string, pair<uintptr_t, vector<interval>>> mapped;
+  for(const auto& seg : segments) {
+    auto iter = mapped.find(seg.path);
+    if(iter == mapped.end())
+      iter = mapped.emplace(seg.path, make_pair(seg.load_address, vector<interval>())).first;
+    iter->second.second.push_back(interval(seg.base, seg.limit));
+  }
+
+  vector<binary*> opened;
+  {
+    lock_guard<mutex> guard(_lock);
+
+    // Drop binaries that are no longer mapped. Their lines stay in the map so samples
+    // already counted are still reported.
+    size_t closed = 0;
+    for(const auto& b : _binaries) {
+      if(b->state.load() == BinaryUnloaded)
+        continue;
+      auto iter = mapped.find(b->name);
+      if(iter != mapped.end() && iter->second.first == b->load_address) {
+        mapped.erase(iter);
+        continue;
+      }
+      b->state.store(BinaryUnloaded);
+      for(const interval& seg : b->segments) {
+        _ranges.erase(_ranges.lower_bound(seg), _ranges.upper_bound(seg));
+      }
+      VERBOSE << "Removed lines from closed library " << b->name;
+      closed++;
+    }
+
+    // Anything left is newly mapped. Read in-scope binaries right away, since code is
+    // usually loaded to be run.
+    for(auto& entry : mapped) {
+      if(in_scope(entry.first, _binary_scope)) {
+        _binaries.emplace_back(new binary(entry.first, entry.second.first));
+        _binaries.back()->segments = entry.second.second;
+        _binaries.back()->state.store(BinaryRequested);
+        opened.push_back(_binaries.back().get());
       }
     }
+
+    // Loading the opened binaries publishes a table without the closed ones' ranges, so
+    // one dlclose and dlopen pair rebuilds the table and empties PC caches once, not twice
+    if(closed > 0 && opened.empty())
+      freeze_ranges();
   }
 
-  REQUIRE(in_scope_count > 0)
-    << "Debug information was not found for any in-scope executables or libraries";
+  if(!opened.empty()) {
+    load_binaries(opened);
+  }
+}
+
+void memory_map::update_jit_symbols() {
+  // The file name follows the current process, which changes in a forked child
+  pid_t pid = getpid();
+  if(pid != _jit_map_pid) {
+    _jit_map_pid = pid;
+    _jit_map_offset = 0;
+    _jit_map_partial.clear();
+  }
+
+  string path = "/tmp/perf-" + to_string(pid) + ".map";
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return;
+
+  // Read whatever has been appended since the last call
+  char buf[65536];
+  ssize_t n;
+  while((n = pread(fd, buf, sizeof(buf), _jit_map_offset)) > 0) {
+    _jit_map_partial.append(buf, n);
+    _jit_map_offset += n;
+  }
+  close(fd);
+
+  // Each complete line is "<start> <size> <symbol>", with hex start and size
+  size_t added = 0;
+  bool replaced = false;
+  size_t pos = 0;
+  lock_guard<mutex> guard(_lock);
+  for(size_t end = _jit_map_partial.find('\n'); end != string::npos;
+      pos = end + 1, end = _jit_map_partial.find('\n', pos)) {
+    string entry = _jit_map_partial.substr(pos, end - pos);
+    char* p = const_cast<char*>(entry.c_str());
+    char* next;
+    uintptr_t start = strtoull(p, &next, 16);
+    if(next == p)
+      continue;
+    p = next;
+    size_t size = strtoull(p, &next, 16);
+    if(next == p || size == 0)
+      continue;
+    while(*next == ' ' || *next == '\t')
+      next++;
+    if(*next == '\0')
+      continue;
+
+    // Code at this address replaces whatever was compiled there before
+    interval range(start, start + size);
+    auto first = _jit_ranges.lower_bound(range);
+    auto last = _jit_ranges.upper_bound(range);
+    if(first != last) {
+      _jit_ranges.erase(first, last);
+      replaced = true;
+    }
+    file* f = get_file(string("[jit] ") + next).get();
+    _jit_ranges.emplace(range, get_line(f, 0));
+    added++;
+  }
+  _jit_map_partial.erase(0, pos);
+
+  if(added > 0) {
+    VERBOSE << "Added " << added << " JIT functions from " << path;
+    freeze_jit_ranges();
+    // PC caches may hold the replaced functions' lines, not just misses
+    if(replaced)
+      _generation.fetch_add(1, std::memory_order_release);
+  }
+}
+
+void memory_map::start_loader_thread() {
+  REQUIRE(pipe(_loader_wakeup) == 0) << "Failed to create loader pipe";
+  fcntl(_loader_wakeup[1], F_SETFL, O_NONBLOCK);
+  fcntl(_loader_wakeup[0], F_SETFD, FD_CLOEXEC);
+  fcntl(_loader_wakeup[1], F_SETFD, FD_CLOEXEC);
+
+  pthread_t thread;
+#ifdef __APPLE__
+  int rc = coz_orig_pthread_create(&thread, nullptr, memory_map::start_loader, this);
+#else
+  int rc = real::pthread_create(&thread, nullptr, memory_map::start_loader, this);
+#endif
+  REQUIRE(rc == 0) << "Failed to start loader thread";
+  pthread_detach(thread);
+}
+
+void memory_map::after_fork(bool child) {
+  if(child) {
+    // Lookups in progress on the parent's other threads never finish in the child
+    for(reader_count& r : _readers) {
+      r.count.store(0);
+    }
+  }
+  _lock.unlock();
+
+  if(child && _loader_wakeup[0] != -1) {
+    // Writing to the inherited pipe would wake the parent's loader instead
+    close(_loader_wakeup[0]);
+    close(_loader_wakeup[1]);
+    start_loader_thread();
+  }
+}
+
+void* memory_map::start_loader(void* p) {
+  static_cast<memory_map*>(p)->loader();
+  return nullptr;
+}
+
+void memory_map::loader() {
+#ifndef __APPLE__
+  _loader_tid.store(static_cast<pid_t>(syscall(SYS_gettid)));
+#endif
+  while(true) {
+    // Wait for a lazy request, but check for dlopen and dlclose regularly
+    struct pollfd pfd = {_loader_wakeup[0], POLLIN, 0};
+    int rc = poll(&pfd, 1, LoaderPollInterval);
+    if(rc < 0 && errno != EINTR)
+      return;
+    if(rc > 0) {
+      char buf[64];
+      if(read(_loader_wakeup[0], buf, sizeof(buf)) == 0)
+        return;
+    }
+
+    try {
+      size_t loaded_objects = count_loaded_objects();
+      if(loaded_objects != _loaded_objects) {
+        _loaded_objects = loaded_objects;
+        update_binaries();
+      }
+
+      if(_jit_maps) {
+        update_jit_symbols();
+      }
+
+      vector<binary*> requested;
+      {
+        lock_guard<mutex> guard(_lock);
+        reclaim_tables();
+        for(const auto& b : _binaries) {
+          if(b->state.load() == BinaryRequested)
+            requested.push_back(b.get());
+        }
+      }
+
+      if(!requested.empty()) {
+        size_t start_time = get_time();
+        load_binaries(requested);
+        VERBOSE << "Read debug information for " << requested.size() << " sampled binaries in "
+                << (get_time() - start_time) / 1000000 << "ms";
+      }
+    } catch(const exception& e) {
+      WARNING << "Reading debug information failed: " << e.what();
+    }
+  }
 }
 
 dwarf::value find_attribute(const dwarf::die& d, dwarf::DW_AT attr) {
@@ -407,35 +917,76 @@ dwarf::value find_attribute(const dwarf::die& d, dwarf::DW_AT attr) {
   return dwarf::value();
 }
 
-void memory_map::add_range(std::string filename, size_t line_no, interval range) {
-  shared_ptr<file> f = get_file(filename);
-  shared_ptr<line> l = f->get_line(line_no);
+void memory_map::add_range(file* f, size_t line_no, interval range) {
+  line* l = get_line(f, line_no);
   // Add the entry
   _ranges.emplace(range, l);
 }
 
+void memory_map::freeze_ranges() {
+  publish_table(_ranges, _table);
+  _generation.fetch_add(1, std::memory_order_release);
+}
+
+void memory_map::freeze_jit_ranges() {
+  publish_table(_jit_ranges, _jit_table);
+  _jit_generation.fetch_add(1, std::memory_order_release);
+}
+
+void memory_map::publish_table(const map<interval, line*>& ranges,
+                               atomic<range_table<line>*>& current) {
+  range_table<line>* table = new range_table<line>();
+  table->reserve(ranges.size());
+  // The map holds non-overlapping intervals in address order, as the table requires
+  for(const auto& entry : ranges) {
+    table->add(entry.first.get_base(), entry.first.get_limit(), entry.second);
+  }
+  table->freeze();
+
+  // Readers may be in the middle of a lookup in the old table, so it is freed later
+  range_table<line>* old = current.exchange(table);
+  if(old != &_empty_table) {
+    _retired_tables.emplace_back(old);
+  }
+  VERBOSE << "Built address lookup table with " << table->size() << " ranges";
+
+  reclaim_tables();
+}
+
+void memory_map::reclaim_tables() {
+  if(_retired_tables.empty())
+    return;
+
+  // A lookup that read a retired table counted itself first. Once every slot has been
+  // seen at zero since the table was replaced, each such lookup has finished, and any
+  // lookup counted later reads the current table. Otherwise try again on the next poll.
+  size_t retired = _retired_tables.size();
+  for(const reader_count& r : _readers) {
+    if(r.count.load() != 0)
+      return;
+  }
+  _retired_tables.erase(_retired_tables.begin(), _retired_tables.begin() + retired);
+}
+
 void memory_map::process_inlines(const dwarf::die& d,
-                                 const dwarf::line_table& table,
-                                 const unordered_set<string>& source_scope,
+                                 line_table_files& files,
                                  uintptr_t load_address,
-                                 bool allow_system_sources,
                                  vector<memory_map::queued_range>& pending,
-                                 const string& parent_file,
+                                 const source_file* parent_file,
                                  size_t parent_line,
                                  bool parent_in_scope) {
   if(!d.valid())
     return;
 
-  string attribution_file = parent_file;
+  const source_file* attribution_file = parent_file;
   size_t attribution_line = parent_line;
-  bool attribution_valid = parent_in_scope && !parent_file.empty();
+  bool attribution_valid = parent_in_scope && parent_file != nullptr && !parent_file->path.empty();
 
   try {
     if(d.tag == dwarf::DW_TAG::inlined_subroutine) {
-      string call_file;
-      if(d.has(dwarf::DW_AT::call_file) && table.valid()) {
-        call_file = table.get_file(d[dwarf::DW_AT::call_file].as_uconstant())->path;
-        call_file = canonicalize_path(call_file);
+      const source_file* call_file = nullptr;
+      if(d.has(dwarf::DW_AT::call_file) && files.table().valid()) {
+        call_file = files.get(d[dwarf::DW_AT::call_file].as_uconstant());
       }
 
       size_t call_line = 0;
@@ -443,9 +994,8 @@ void memory_map::process_inlines(const dwarf::die& d,
         call_line = d[dwarf::DW_AT::call_line].as_uconstant();
       }
 
-      bool call_in_scope = file_matches_scope(call_file, source_scope, allow_system_sources);
-      bool prefer_new_attribution = !attribution_valid || !is_system_path(call_file);
-      if(call_in_scope && !call_file.empty() && prefer_new_attribution) {
+      bool call_in_scope = call_file != nullptr && call_file->in_scope;
+      if(call_in_scope && (!attribution_valid || !call_file->is_system)) {
         attribution_file = call_file;
         attribution_line = call_line;
         attribution_valid = true;
@@ -496,10 +1046,8 @@ void memory_map::process_inlines(const dwarf::die& d,
 
       for(const auto& child : d) {
         process_inlines(child,
-                        table,
-                        source_scope,
+                        files,
                         load_address,
-                        allow_system_sources,
                         pending,
                         attribution_file,
                         attribution_line,
@@ -513,10 +1061,8 @@ void memory_map::process_inlines(const dwarf::die& d,
 
   for(const auto& child : d) {
     process_inlines(child,
-                    table,
-                    source_scope,
+                    files,
                     load_address,
-                    allow_system_sources,
                     pending,
                     attribution_file,
                     attribution_line,
@@ -524,138 +1070,191 @@ void memory_map::process_inlines(const dwarf::die& d,
   }
 }
 
-bool memory_map::process_file(const string& name, uintptr_t load_address,
-                              const unordered_set<string>& source_scope,
-                              bool allow_system_sources) {
-  // Use unified LIEF-based loader for both ELF and Mach-O
-  auto loader = lief_loader::load(name);
-  if(!loader) {
-    return false;
-  }
-  dwarf::dwarf d(loader);
-
-#ifndef __APPLE__
-  // On Linux, adjust load_address for static executables (ET_EXEC)
-  // Static executables are loaded at fixed addresses (typically 0)
-  // PIE executables and shared libraries (ET_DYN) use the load address from /proc/self/maps
-  if(lief_loader::is_static_executable(name)) {
-    load_address = 0;
-  }
-#endif
-  // On macOS, load_address is already the ASLR slide from dyld
-
-  vector<memory_map::queued_range> pending;
-
-  // Walk through the compilation units (source files) in the executable
-  for(auto unit : d.compilation_units()) {
-
-    try {
-      string prev_filename;
-      size_t prev_line;
-      uintptr_t prev_address = 0;
-      set<string> included_files;
-      dwarf::line_table table;
+void memory_map::process_unit(const dwarf::compilation_unit& unit,
+                              source_file_cache& cache,
+                              vector<memory_map::queued_range>& pending) {
+  try {
+    const source_file* prev_file = nullptr;
+    size_t prev_line;
+    uintptr_t prev_address = 0;
+    dwarf::line_table table;
 #ifdef __APPLE__
-      // On macOS, catch DWARF parsing errors and skip problematic CUs
-      try {
-        table = unit.get_line_table();
-      } catch (const dwarf::format_error& e) {
-        continue;
-      } catch (const std::exception& e) {
-        continue;
-      }
-#else
-      // On Linux, let DWARF parsing exceptions propagate for proper error reporting
+    // On macOS, catch DWARF parsing errors and skip problematic CUs
+    try {
       table = unit.get_line_table();
+    } catch (const dwarf::format_error& e) {
+      return;
+    } catch (const std::exception& e) {
+      return;
+    }
+#else
+    // On Linux, let DWARF parsing exceptions propagate for proper error reporting
+    table = unit.get_line_table();
 #endif
-      if(!table.valid()) {
-        continue;
-      }
-      vector<subprogram_range> subprograms;
-      collect_subprogram_ranges(unit.root(),
-                                table,
-                                source_scope,
-                                allow_system_sources,
-                                subprograms);
-      sort(subprograms.begin(), subprograms.end(),
-           [](const subprogram_range& a, const subprogram_range& b) {
-             if(a.low != b.low)
-               return a.low < b.low;
-             return a.high < b.high;
-           });
-
-      // Walk through the line instructions in the DWARF line table
-      for(auto& line_info : table) {
-        // Insert an entry if this isn't the first line command in the sequence
-        if(file_matches_scope(prev_filename, source_scope, allow_system_sources)) {
-          if(prev_address != 0) {
-            const subprogram_range* owner = find_subprogram(subprograms, prev_address);
-            if(owner && owner->in_scope) {
-              bool owner_is_system = is_system_path(owner->filename);
-              bool prev_is_system = is_system_path(prev_filename);
-              if(prev_is_system && !owner_is_system) {
-                prev_filename = owner->filename;
-                prev_line = owner->line;
-              }
+    if(!table.valid()) {
+      return;
+    }
+    line_table_files files(table, cache);
+    vector<subprogram_range> subprograms;
+    collect_subprogram_ranges(unit.root(), files, subprograms);
+    sort(subprograms.begin(), subprograms.end(),
+         [](const subprogram_range& a, const subprogram_range& b) {
+           if(a.low != b.low)
+             return a.low < b.low;
+           return a.high < b.high;
+         });
+
+    // Walk through the line instructions in the DWARF line table
+    for(auto& line_info : table) {
+      // Insert an entry if this isn't the first line command in the sequence
+      if(prev_file != nullptr && prev_file->in_scope) {
+        if(prev_address != 0) {
+          const subprogram_range* owner = find_subprogram(subprograms, prev_address);
+          if(owner && owner->in_scope) {
+            if(prev_file->is_system && !owner->file->is_system) {
+              prev_file = owner->file;
+              prev_line = owner->line;
             }
           }
-          if(prev_address != 0) {
-            included_files.insert(prev_filename);
-            enqueue_range(pending,
-                          prev_filename,
-                          prev_line,
-                          interval(prev_address, line_info.address) + load_address);
-          }
         }
-
-        if(line_info.end_sequence || line_info.line == 0) {
-          prev_address = 0;
-        } else {
-          prev_filename = canonicalize_path(line_info.file->path);
-          prev_line = line_info.line;
-          prev_address = line_info.address;
+        if(prev_address != 0) {
+          enqueue_range(pending,
+                        prev_file,
+                        prev_line,
+                        interval(prev_address, line_info.address));
         }
       }
-      process_inlines(unit.root(),
-                      table,
-                      source_scope,
-                      load_address,
-                      allow_system_sources,
-                      pending);
-
-      for(const string& filename : included_files) {
-        VERBOSE << "Included source file " << filename;
+
+      if(line_info.end_sequence || line_info.line == 0) {
+        prev_address = 0;
+      } else {
+        prev_file = files.get(line_info.file_index);
+        prev_line = line_info.line;
+        prev_address = line_info.address;
       }
+    }
+    process_inlines(unit.root(), files, 0, pending);
+
+  } catch(dwarf::format_error e) {
+    (void)e;
+  }
+}
+
+bool memory_map::process_file(const string& name,
+                              size_t workers,
+                              debug_info& info) {
+  size_t start_time = get_time();
+
+  string cache_path;
+  if(!_cache_dir.empty()) {
+    cache_path = line_map_cache::entry_path(_cache_dir, name, _cache_key);
+    if(!cache_path.empty() && line_map_cache::load(cache_path, info)) {
+      info.from_cache = true;
+      info.parse_time = get_time() - start_time;
+      return true;
+    }
+  }
+
+  // Use unified LIEF-based loader for both ELF and Mach-O
+  auto loader = lief_loader::load(name);
+  if(!loader) {
+    return false;
+  }
 
-    } catch(dwarf::format_error e) {
-      (void)e;
+  // Ranges are collected at link-time addresses and relocated when they are added to the map.
+  // On Linux, static executables (ET_EXEC) are loaded at those addresses; PIE executables and
+  // shared libraries (ET_DYN) use the load address from /proc/self/maps. On macOS, the load
+  // address is the ASLR slide from dyld.
+  info.is_static = lief_loader::is_static_executable(name);
+
+  // libelfin decodes sections and abbreviations lazily and does not lock, so each
+  // worker reads through its own dwarf object. The loader's section data is shared.
+  vector<unique_ptr<dwarf::dwarf>> readers;
+  readers.emplace_back(new dwarf::dwarf(loader));
+  size_t units = readers[0]->compilation_units().size();
+  workers = max<size_t>(1, min(workers, units));
+
+  vector<vector<memory_map::queued_range>> pending(workers);
+  vector<exception_ptr> failures(workers);
+  readers.resize(workers);
+
+  // Source file names are canonicalized and matched once per worker. The merged ranges
+  // point into these caches until they are converted to file table indices below.
+  vector<unique_ptr<source_file_cache>> sources(workers);
+
+  atomic<size_t> next_unit(0);
+  run_workers(workers, [&](size_t w) {
+    try {
+      if(!readers[w])
+        readers[w].reset(new dwarf::dwarf(loader));
+      sources[w].reset(new source_file_cache(_source_scope, _default_source_scope,
+                                             _allow_system_sources));
+      const auto& cus = readers[w]->compilation_units();
+      for(size_t i = next_unit++; i < units; i = next_unit++) {
+        process_unit(cus[i], *sources[w], pending[w]);
+      }
+      sort(pending[w].begin(), pending[w].end(), queued_range_less);
+    } catch(...) {
+      failures[w] = current_exception();
     }
+  });
+
+  for(auto& failure : failures) {
+    if(failure)
+      rethrow_exception(failure);
+  }
+
+  // Merge the sorted per-worker runs pairwise, one round at a time
+  for(size_t stride = 1; stride < workers; stride *= 2) {
+    size_t pairs = (workers + 2 * stride - 1) / (2 * stride);
+    run_workers(pairs, [&](size_t p) {
+      size_t a = p * 2 * stride;
+      size_t b = a + stride;
+      if(b >= workers)
+        return;
+      vector<memory_map::queued_range> merged;
+      merged.reserve(pending[a].size() + pending[b].size());
+      merge(make_move_iterator(pending[a].begin()), make_move_iterator(pending[a].end()),
+            make_move_iterator(pending[b].begin()), make_move_iterator(pending[b].end()),
+            back_inserter(merged), queued_range_less);
+      pending[a].swap(merged);
+      vector<memory_map::queued_range>().swap(pending[b]);
+    });
+  }
+
+  // Replace file names with indices into a sorted file table
+  map<string, uint32_t> file_index;
+  for(const auto& entry : pending[0]) {
+    file_index.emplace(*entry.filename, 0);
+  }
+  info.files.clear();
+  for(auto& f : file_index) {
+    f.second = info.files.size();
+    info.files.push_back(f.first);
   }
 
-  std::sort(pending.begin(), pending.end(),
-            [](const memory_map::queued_range& a, const memory_map::queued_range& b) {
-              if(a.range.get_base() != b.range.get_base())
-                return a.range.get_base() < b.range.get_base();
-              if(a.range.get_limit() != b.range.get_limit())
-                return a.range.get_limit() < b.range.get_limit();
-              if(a.preferred != b.preferred)
-                return a.preferred && !b.preferred;
-              if(a.line != b.line)
-                return a.line < b.line;
-              return a.filename < b.filename;
-            });
-  for(auto& entry : pending) {
-    add_range(entry.filename, entry.line, entry.range);
+  info.ranges.clear();
+  info.ranges.reserve(pending[0].size());
+  for(const auto& entry : pending[0]) {
+    info.ranges.push_back(debug_range{entry.range.get_base(),
+                                      entry.range.get_limit(),
+                                      file_index[*entry.filename],
+                                      static_cast<uint32_t>(entry.line)});
+  }
+  info.parse_time = get_time() - start_time;
+
+  if(!cache_path.empty() && line_map_cache::store(cache_path, info)) {
+    VERBOSE << "Saved line map for " << name << " to " << cache_path;
   }
 
   return true;
 }
 
-shared_ptr<line> memory_map::find_line(const string& name) {
+line* memory_map::find_line(const string& name) {
   string::size_type colon_pos = name.find_first_of(':');
   if(colon_pos == string::npos) {
     WARNING << "Could not identify file name in input " << name;
-    return shared_ptr<line>();
+    return nullptr;
   }
 
   string filename = name.substr(0, colon_pos);
@@ -664,29 +1263,23 @@ shared_ptr<line> memory_map::find_line(const string& name) {
   size_t line_no;
   stringstream(line_no_str) >> line_no;
 
+  // Files may be added by the loader thread while the map is searched
+  std::lock_guard<std::mutex> guard(_lock);
   for(const auto& f : files()) {
     string::size_type last_pos = f.first.rfind(filename);
     if(last_pos != string::npos && last_pos + filename.size() == f.first.size()) {
-      if(f.second->has_line(line_no)) {
-        return f.second->get_line(line_no);
+      line* l = f.second->find_line(line_no);
+      if(l) {
+        return l;
       }
     }
   }
 
-  return shared_ptr<line>();
-}
-
-shared_ptr<line> memory_map::find_line(uintptr_t addr) {
-  auto iter = _ranges.find(addr);
-  if(iter != _ranges.end()) {
-    return iter->second;
-  } else {
-    return shared_ptr<line>();
-  }
+  return nullptr;
 }
 
 memory_map& memory_map::get_instance() {
-  static char buf[sizeof(memory_map)];
+  alignas(memory_map) static char buf[sizeof(memory_map)];
   static memory_map* the_instance = new(buf) memory_map();
   return *the_instance;
 }
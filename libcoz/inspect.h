@@ -10,17 +10,25 @@
 
 #include <atomic>
 #include <cstdint>
+#include <deque>
 #include <ios>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <string>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <sys/types.h>
+
+#include "range_table.h"
+#include "scope_matcher.h"
+
 namespace dwarf {
+  class compilation_unit;
   class die;
   class line_table;
 }
@@ -28,22 +36,29 @@ namespace dwarf {
 class file;
 class interval;
 class line;
+class line_table_files;
 class memory_map;
+class source_file_cache;
+struct source_file;
 
 /**
  * Handle for a single line in the program's memory map
  */
 class line {
 public:
-  line(std::weak_ptr<file> f, size_t l) : _file(f), _line(l) {}
+  line(file* f, size_t l) : _file(f), _line(l) {}
   
-  inline std::shared_ptr<file> get_file() const { return _file.lock(); }
+  inline file* get_file() const { return _file; }
   inline size_t get_line() const { return _line; }
-  inline void add_sample() { _samples.fetch_add(1, std::memory_order_relaxed); }
+  /// Add samples to the shared count. The sampling path counts in per-thread shards instead.
+  inline void add_samples(size_t n) { _samples.fetch_add(n, std::memory_order_relaxed); }
+  /// Get the shared count. profiler::get_samples() adds counts still held in per-thread shards.
   inline size_t get_samples() const { return _samples.load(std::memory_order_relaxed); }
+  /// Drop the shared count, such as the parent's samples in a forked child
+  inline void clear_samples() { _samples.store(0, std::memory_order_relaxed); }
  
 private:
-  std::weak_ptr<file> _file;
+  file* _file;
   size_t _line;
   std::atomic<size_t> _samples = ATOMIC_VAR_INIT(0);
 };
@@ -93,7 +108,7 @@ private:
 /**
  * Handle for a file in the program's memory map
  */
-class file : public std::enable_shared_from_this<file> {
+class file {
 public:
   explicit file(const std::string& name) : _name(name) {}
   file(const file&) = default;
@@ -101,30 +116,24 @@ public:
   
   inline const std::string& get_name() const { return _name; }
   
-  inline const std::map<size_t, std::shared_ptr<line>> lines() const {
+  inline const std::map<size_t, line*>& lines() const {
     return _lines;
   }
   
 private:
   friend class memory_map;
   
-  inline std::shared_ptr<line> get_line(size_t index) {
+  inline line* find_line(size_t index) const {
     auto iter = _lines.find(index);
     if(iter != _lines.end()) {
       return iter->second;
     } else {
-      std::shared_ptr<line> l(new line(shared_from_this(), index));
-      _lines.emplace(index, l);
-      return l;
+      return nullptr;
     }
   }
   
-  inline bool has_line(size_t index) {
-    return _lines.find(index) != _lines.end();
-  }
-  
   std::string _name;
-  std::map<size_t, std::shared_ptr<line>> _lines;
+  std::map<size_t, line*> _lines;   //< Lines in this file, stored in the memory map's line arena
 };
 
 /**
@@ -134,28 +143,102 @@ private:
 class memory_map {
 public:
   struct queued_range {
-    std::string filename;
+    const std::string* filename;   //< Canonical path, owned by a source_file_cache
     size_t line;
     interval range;
     bool preferred;
   };
+
+  /// A source line's address range, at link-time addresses
+  struct debug_range {
+    uintptr_t base;
+    uintptr_t limit;
+    uint32_t file;  //< Index into debug_info::files
+    uint32_t line;
+  };
+
+  /// Address ranges and source files collected from one binary's debug information.
+  /// This is the unit stored in the on-disk line map cache.
+  struct debug_info {
+    std::vector<std::string> files;     //< Source files with at least one range
+    std::vector<debug_range> ranges;    //< In-scope ranges, sorted by address
+    bool is_static = false;             //< Binary is loaded at its link-time addresses
+    bool from_cache = false;            //< Loaded from the line map cache
+    size_t parse_time = 0;              //< Time spent reading the binary (ns)
+  };
+  /// Only stable once build() returns, and only in eager mode. Use for_each_line() while profiling.
   inline const std::map<std::string, std::shared_ptr<file>>& files() const { return _files; }
-  inline const std::map<interval, std::shared_ptr<line>>& ranges() const { return _ranges; }
+  inline const std::map<interval, line*>& ranges() const { return _ranges; }
   
   /// Build a map from addresses to source lines by examining binaries that match the provided
-  /// scope patterns, adding only source files matching the source scope patterns.
+  /// scope patterns, adding only source files matching the source scope patterns. In lazy mode,
+  /// only the binaries' address ranges are recorded, and each binary's debug information is
+  /// read on a background thread the first time an address inside it is looked up. The same
+  /// thread adds binaries opened later with dlopen and removes those closed with dlclose, and
+  /// if jit_maps is set, follows the JIT symbol file /tmp/perf-<pid>.map as it grows.
   void build(const std::unordered_set<std::string>& binary_scope,
              const std::unordered_set<std::string>& source_scope,
-             bool allow_system_sources);
+             bool allow_system_sources,
+             const std::string& cache_dir = std::string(),
+             bool lazy = false,
+             bool jit_maps = false);
   
-  std::shared_ptr<line> find_line(const std::string& name);
-  std::shared_ptr<line> find_line(uintptr_t addr);
+  line* find_line(const std::string& name);
+
+  /// Find the line containing an address. Only valid once build() has returned.
+  /// Safe to call from a signal handler.
+  inline line* find_line(uintptr_t addr) const {
+    // Count the lookup as in progress, so the table it reads is not freed under it
+    std::atomic<size_t>& readers = _readers[reader_slot()].count;
+    readers.fetch_add(1);
+    line* l = _table.load()->find(addr);
+    if(l == nullptr)
+      l = _jit_table.load()->find(addr);
+    readers.fetch_sub(1, std::memory_order_release);
+    if(l == nullptr && !_lazy_segments.empty())
+      request_binary(addr);
+    return l;
+  }
+
+  /// Get a counter that changes whenever lines are added, so callers can drop cached misses
+  inline size_t get_generation() const { return _generation.load(std::memory_order_acquire); }
+
+  /// Get a counter that changes whenever JIT functions are added. JIT code only appears
+  /// at addresses that had no line, so callers only need to drop cached misses.
+  inline size_t get_jit_generation() const { return _jit_generation.load(std::memory_order_acquire); }
+
+  /// Get the loader thread's TID, or 0 if it has not started (Linux)
+  inline pid_t get_loader_tid() const { return _loader_tid.load(std::memory_order_relaxed); }
+
+  /// Hold the map's lock across fork, so a forked child never inherits it locked
+  void before_fork() { _lock.lock(); }
+
+  /// Release the lock taken by before_fork(). The loader thread does not survive in a child,
+  /// and its wakeup pipe is shared with the parent, so a child starts its own.
+  void after_fork(bool child);
+
+  /// Call fn(line*) for every line in the map, excluding concurrent additions
+  template<typename F>
+  void for_each_line(F fn) {
+    std::lock_guard<std::mutex> guard(_lock);
+    for(const auto& file_entry : _files) {
+      for(const auto& line_entry : file_entry.second->lines()) {
+        fn(line_entry.second);
+      }
+    }
+  }
   
   static memory_map& get_instance();
   
 private:
+  enum {
+    ReaderSlotBits = 6  //< Log2 of the number of slots lookups are counted in
+  };
+
   memory_map() : _files(std::map<std::string, std::shared_ptr<file>>()),
-                 _ranges(std::map<interval, std::shared_ptr<line>>()) {}
+                 _ranges(std::map<interval, line*>()),
+                 _table(&_empty_table),
+                 _jit_table(&_empty_table) {}
   memory_map(const memory_map&) = delete;
   memory_map& operator=(const memory_map&) = delete;
   
@@ -170,26 +253,150 @@ private:
     }
   }
   
-  void add_range(std::string filename, size_t line_no, interval range);
+  /// Get or create the line with a given index in a file. Lines never move or go away.
+  inline line* get_line(file* f, size_t index) {
+    line* l = f->find_line(index);
+    if(l == nullptr) {
+      _lines.emplace_back(f, index);
+      l = &_lines.back();
+      f->_lines.emplace(index, l);
+    }
+    return l;
+  }
   
-  /// Find a debug version of provided file and add all of its in-scope lines to the map
-  bool process_file(const std::string& name, uintptr_t load_address,
-                    const std::unordered_set<std::string>& source_scope,
-                    bool allow_system_sources);
+  /// States of an in-scope binary
+  enum {
+    BinaryDeferred,   //< Not yet sampled
+    BinaryRequested,  //< Sampled or newly loaded, waiting for the loader thread
+    BinaryLoaded,     //< Lines added to the map, or no debug information found
+    BinaryFailed,     //< Reading debug information failed; not retried
+    BinaryUnloaded    //< Unmapped by dlclose, with its ranges removed from the map
+  };
+
+  /// An in-scope binary, with its executable segments and loading state
+  struct binary {
+    std::string name;
+    uintptr_t load_address;
+    std::vector<interval> segments;
+    std::atomic<int> state;
+
+    binary(const std::string& n, uintptr_t a) : name(n), load_address(a), state(BinaryDeferred) {}
+  };
+
+  /// An executable segment of a binary whose debug information is read on demand
+  struct lazy_segment {
+    uintptr_t base;
+    uintptr_t limit;
+    binary* owner;
+  };
+
+  void add_range(file* f, size_t line_no, interval range);
+
+  /// Read debug information for binaries in parallel and add their lines in order.
+  /// Returns the number of binaries with debug information.
+  size_t load_binaries(const std::vector<binary*>& binaries);
+
+  /// Publish a new flat lookup table built from the range map, used while sampling
+  void freeze_ranges();
+
+  /// Publish a new lookup table for JIT functions, which is searched after the main table
+  void freeze_jit_ranges();
+
+  /// Build a lookup table from a range map and publish it in place of an older one
+  void publish_table(const std::map<interval, line*>& ranges,
+                     std::atomic<range_table<line>*>& current);
+
+  /// Free replaced tables once no lookup that could have read them is still running.
+  /// Called with _lock held.
+  void reclaim_tables();
+
+  /// Pick the reader slot for a lookup from the caller's stack address. Each thread has
+  /// its own stack, so threads mostly count their lookups in different slots.
+  static inline size_t reader_slot() {
+    uintptr_t sp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    return static_cast<size_t>(((sp >> 16) * 0x9E3779B97F4A7C15ULL) >> (64 - ReaderSlotBits));
+  }
+
+  /// Ask the loader thread to read the binary containing addr, if it has not been read yet
+  void request_binary(uintptr_t addr) const;
+
+  /// Wake the loader thread. Safe to call from a signal handler.
+  void wake_loader() const;
+
+  /// Get a count that changes whenever the dynamic loader maps or unmaps an object
+  size_t count_loaded_objects() const;
+
+  /// Add in-scope binaries opened with dlopen and drop the ranges of binaries closed with dlclose
+  void update_binaries();
+
+  /// Add functions appended to the JIT symbol file since the last call. Each function becomes
+  /// a line in a file named "[jit] <symbol>".
+  void update_jit_symbols();
+
+  /// Open the loader's wakeup pipe and start the loader thread
+  void start_loader_thread();
+
+  /// Body of the background thread that reads requested binaries and follows dlopen/dlclose
+  void loader();
+  static void* start_loader(void*);
+  
+  /// Find a debug version of provided file and collect all of its in-scope lines,
+  /// reading compilation units on up to `workers` threads. Uses the line map
+  /// cache when one is configured.
+  bool process_file(const std::string& name,
+                    size_t workers,
+                    debug_info& info);
+  
+  /// Collect the in-scope line table and inlined call ranges for one compilation unit,
+  /// at link-time addresses
+  void process_unit(const dwarf::compilation_unit& unit,
+                    source_file_cache& cache,
+                    std::vector<queued_range>& pending);
   
   /// Add entries for all inlined calls
   void process_inlines(const dwarf::die& d,
-                       const dwarf::line_table& table,
-                       const std::unordered_set<std::string>& source_scope,
+                       line_table_files& files,
                        uintptr_t load_address,
-                       bool allow_system_sources,
                        std::vector<queued_range>& pending,
-                       const std::string& parent_file = std::string(),
+                       const source_file* parent_file = nullptr,
                        size_t parent_line = 0,
                        bool parent_in_scope = false);
   
   std::map<std::string, std::shared_ptr<file>> _files;
-  std::map<interval, std::shared_ptr<line>> _ranges;
+  std::deque<line> _lines;    //< Arena for every line, so plain line* handles stay valid
+  std::map<interval, line*> _ranges;
+  std::mutex _lock;           //< Held while lines or ranges are added
+  range_table<line> _empty_table;
+  std::atomic<range_table<line>*> _table;   //< Current lookup table
+  std::vector<std::unique_ptr<range_table<line>>> _retired_tables;  //< Replaced tables that
+                                            //< lookups in progress may still be reading
+  std::atomic<size_t> _generation{0};       //< Bumped each time a table is published
+  std::map<interval, line*> _jit_ranges;    //< Functions from the JIT symbol file
+  std::atomic<range_table<line>*> _jit_table;   //< Current lookup table for JIT functions
+  std::atomic<size_t> _jit_generation{0};   //< Bumped each time a JIT table is published
+
+  /// Lookups in progress, counted in slots spread over cache lines to keep threads apart
+  struct alignas(64) reader_count {
+    std::atomic<size_t> count{0};
+  };
+  mutable reader_count _readers[1 << ReaderSlotBits];
+
+  scope_matcher _binary_scope;
+  scope_matcher _source_scope;
+  bool _default_source_scope = false;   //< Source scope is the default "%" pattern
+  bool _allow_system_sources = true;
+  std::vector<std::unique_ptr<binary>> _binaries;   //< In-scope binaries
+  std::vector<lazy_segment> _lazy_segments;          //< Segments of deferred binaries, by address
+  int _loader_wakeup[2] = {-1, -1};                  //< Pipe written to wake the loader thread
+  std::atomic<pid_t> _loader_tid{0};                 //< The loader thread, once it has started
+  size_t _loaded_objects = 0;                        //< Last count_loaded_objects() result
+
+  bool _jit_maps = false;     //< Follow the JIT symbol file
+  pid_t _jit_map_pid = 0;     //< Process the symbol file was read for
+  off_t _jit_map_offset = 0;  //< Bytes of the symbol file consumed so far
+  std::string _jit_map_partial;   //< Trailing text not yet terminated by a newline
+  std::string _cache_dir;     //< Directory for cached line maps, or empty if caching is off
+  std::string _cache_key;     //< Hash of the settings that affect a cached line map
 };
 
 static std::ostream& operator<<(std::ostream& os, const interval& i) {
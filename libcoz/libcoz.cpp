@@ -6,6 +6,7 @@
  */
 
 #include <dlfcn.h>
+#include <errno.h>
 #ifdef __APPLE__
   #include <limits.h>
   #include <mach-o/dyld.h>
@@ -13,9 +14,18 @@
   #include <linux/limits.h>
 #endif
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
+#ifndef __APPLE__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+
+#include <atomic>
 #include <sstream>
 #include <string>
 #include <unordered_set>
@@ -43,6 +53,10 @@ static bool end_to_end = false;
 bool initialized = false;
 static bool init_in_progress = false;
 
+/// Environment entries that keep coz loaded in programs started with exec, saved at startup
+/// when following exec. They are added to environments passed to execve and posix_spawn.
+static vector<string> coz_env;
+
 /**
  * Called by the application at progress points to check and apply delays.
  * This ensures worker threads check their delay debt at progress points,
@@ -185,12 +199,34 @@ void init_coz(void) {
   VERBOSE << "bootstrapping coz";
   initialized = false;
 
-  // Remove Coz from LD_PRELOAD. Just clearing LD_PRELOAD for now FIXME!
-  unsetenv("LD_PRELOAD");
+  // Keep coz loaded in programs started with exec only if requested
+  bool follow_exec = getenv("COZ_FOLLOW_EXEC");
+  if(!follow_exec) {
+    // Remove Coz from LD_PRELOAD. Just clearing LD_PRELOAD for now FIXME!
+    unsetenv("LD_PRELOAD");
+  }
 
   // Read settings out of environment variables
   string output_file = getenv_safe("COZ_OUTPUT", "profile.coz");
 
+  if(follow_exec) {
+    // The first profiled process writes the output file, and the processes it starts
+    // write their own files named for their PIDs
+    string pid = to_string(getpid());
+    string root_pid = getenv_safe("COZ_ROOT_PID");
+    if(root_pid.empty()) {
+      setenv("COZ_ROOT_PID", pid.c_str(), 1);
+    } else if(root_pid != pid) {
+      output_file = get_process_output(output_file, getpid());
+    }
+
+    for(char** e = environ; *e != nullptr; e++) {
+      if(strncmp(*e, "COZ_", 4) == 0 || strncmp(*e, "LD_PRELOAD=", 11) == 0) {
+        coz_env.push_back(*e);
+      }
+    }
+  }
+
   vector<string> binary_scope_v = split(getenv_safe("COZ_BINARY_SCOPE"), '\t');
   unordered_set<string> binary_scope(binary_scope_v.begin(), binary_scope_v.end());
 
@@ -236,7 +272,22 @@ void init_coz(void) {
   // Build the memory map for all in-scope binaries
   bool filter_system_sources = getenv("COZ_FILTER_SYSTEM");
 
-  memory_map::get_instance().build(binary_scope, source_scope, !filter_system_sources);
+  // Reuse line maps from earlier runs if a cache directory was given
+  string line_cache_dir = getenv_safe("COZ_LINE_CACHE", "");
+
+  // Defer reading debug information until a binary is sampled. A fixed line must be
+  // resolved by name before profiling starts, so it needs every binary read up front.
+  bool lazy_symbols = getenv("COZ_LAZY_SYMBOLS");
+  if(lazy_symbols && fixed_line_name != "") {
+    VERBOSE << "Reading all debug information up front to find the fixed line";
+    lazy_symbols = false;
+  }
+
+  // Attribute samples in JIT-compiled code using the symbols in /tmp/perf-<pid>.map
+  bool jit_maps = getenv("COZ_JIT_MAPS");
+
+  memory_map::get_instance().build(binary_scope, source_scope, !filter_system_sources,
+                                   line_cache_dir, lazy_symbols, jit_maps);
 
   // Register any sampling progress points
   for(const string& line_name : progress_points) {
@@ -250,7 +301,7 @@ void init_coz(void) {
     FATAL << "Sampling-based progress points are temporarily unsupported";
   }
 
-  shared_ptr<line> fixed_line;
+  line* fixed_line = nullptr;
   if(fixed_line_name != "") {
     fixed_line = memory_map::get_instance().find_line(fixed_line_name);
     REQUIRE(fixed_line) << "Fixed line \"" << fixed_line_name << "\" was not found.";
@@ -264,7 +315,7 @@ void init_coz(void) {
 
   // Start the profiler
   profiler::get_instance().startup(output_file,
-                                   fixed_line.get(),
+                                   fixed_line,
                                    fixed_speedup,
                                    end_to_end);
 
@@ -355,6 +406,83 @@ static bool is_coz_signal(int signum) {
   return signum == SampleSignal || signum == SIGSEGV || signum == SIGABRT;
 }
 
+#ifndef __APPLE__
+/// What a file descriptor refers to, which decides whether reading it is a blocking call
+enum fd_kind : uint8_t {
+  UnknownFd = 0,  //< Not classified yet
+  PlainFd = 1,    //< A file or device, or any descriptor in non-blocking mode
+  WaitableFd = 2  //< A socket, pipe or eventfd in blocking mode, where a read waits for a writer
+};
+
+enum {
+  FdKindCacheSize = 65536   //< Kinds of descriptors below this number are cached
+};
+
+/**
+ * Kinds of the descriptors passed to read and receive calls. An entry is forgotten when
+ * its descriptor is closed or replaced, or its blocking mode is changed, by any of the
+ * wrappers below. A program that closes a descriptor while another thread reads it may
+ * leave a stale kind, which only decides whether that read is counted as blocking.
+ */
+static std::atomic<uint8_t> fd_kinds[FdKindCacheSize];
+
+static fd_kind classify_fd(int fd) {
+  struct stat st;
+  if(fstat(fd, &st) != 0) return UnknownFd;
+
+  bool waitable = S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode);
+
+  // Anonymous inodes have no file type. Of those, eventfds are used to wake other threads.
+  if((st.st_mode & S_IFMT) == 0) {
+    char path[32];
+    char target[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if(len > 0) {
+      target[len] = '\0';
+      waitable = strcmp(target, "anon_inode:[eventfd]") == 0;
+    }
+  }
+  if(!waitable) return PlainFd;
+
+  // Reads in non-blocking mode return at once, as event loops expect
+  int flags = real::fcntl(fd, F_GETFL);
+  return (flags != -1 && (flags & O_NONBLOCK)) ? PlainFd : WaitableFd;
+}
+
+static void set_fd_kind(int fd, fd_kind kind) {
+  if(fd >= 0 && fd < FdKindCacheSize) fd_kinds[fd].store(kind, std::memory_order_relaxed);
+}
+
+/// Forget the kinds of descriptors first through last, inclusive
+static void forget_fds(unsigned int first, unsigned int last) {
+  if(last >= FdKindCacheSize) last = FdKindCacheSize - 1;
+  for(unsigned int fd = first; fd <= last; fd++) {
+    fd_kinds[fd].store(UnknownFd, std::memory_order_relaxed);
+  }
+}
+
+/// Check if reading a file descriptor may wait for another thread or process
+static bool may_wait(int fd) {
+  if(fd < 0) return false;
+  if(fd >= FdKindCacheSize) return classify_fd(fd) == WaitableFd;
+
+  uint8_t kind = fd_kinds[fd].load(std::memory_order_relaxed);
+  if(kind == UnknownFd) {
+    kind = classify_fd(fd);
+    fd_kinds[fd].store(kind, std::memory_order_relaxed);
+  }
+  return kind == WaitableFd;
+}
+
+/// Finish a blocking call without letting coz's bookkeeping change the errno it set
+static void end_blocking_call(bool skip_delays) {
+  int saved_errno = errno;
+  profiler::get_instance().post_block(skip_delays);
+  errno = saved_errno;
+}
+#endif
+
 #ifdef __APPLE__
 /// Additional helpers called from mac_interpose.cpp
 extern "C" void coz_shutdown() {
@@ -370,6 +498,35 @@ extern "C" void coz_remove_coz_signals(sigset_t* set) {
 }
 #endif
 
+#ifndef __APPLE__
+/**
+ * Add the saved coz environment entries that are missing from an environment passed
+ * to exec or posix_spawn, so the new program is profiled too. Returns envp itself
+ * when nothing is missing, or the merged environment stored in merged.
+ */
+static char* const* add_coz_env(char* const envp[], vector<char*>& merged) {
+  if(coz_env.empty() || envp == nullptr || envp == environ) return envp;
+
+  for(char* const* e = envp; *e != nullptr; e++) {
+    merged.push_back(*e);
+  }
+  size_t given = merged.size();
+
+  for(const string& entry : coz_env) {
+    size_t name_length = entry.find('=') + 1;
+    bool found = false;
+    for(size_t i = 0; i < given && !found; i++) {
+      found = strncmp(merged[i], entry.c_str(), name_length) == 0;
+    }
+    if(!found) merged.push_back(const_cast<char*>(entry.c_str()));
+  }
+
+  if(merged.size() == given) return envp;
+  merged.push_back(nullptr);
+  return merged.data();
+}
+#endif
+
 extern "C" {
 // On macOS, all wrappers are in mac_interpose.cpp using DYLD interposition
 #ifndef __APPLE__
@@ -409,11 +566,21 @@ extern "C" {
     return result;
   }
 
-  /// Skip any global delays added while blocked on a mutex
+  /**
+   * Skip any global delays added while blocked on a mutex. Most acquires are uncontended,
+   * so try the lock first and only treat the call as blocking if the mutex is held.
+   * Any result other than EBUSY (including EOWNERDEAD, which acquires a robust mutex)
+   * is what pthread_mutex_lock would have returned.
+   */
   int pthread_mutex_lock(pthread_mutex_t* mutex) {
-    if(initialized) profiler::get_instance().pre_block();
-    int result = real::pthread_mutex_lock(mutex);
-    if(initialized) profiler::get_instance().post_block(true);
+    if(!initialized) return real::pthread_mutex_lock(mutex);
+
+    int result = real::pthread_mutex_trylock(mutex);
+    if(result != EBUSY) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::pthread_mutex_lock(mutex);
+    profiler::get_instance().post_block(true);
 
     return result;
   }
@@ -473,31 +640,52 @@ extern "C" {
     return result;
   }
 
+  /// As with mutexes, only an rwlock acquire that has to wait is treated as blocking
   int pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) {
-    if(initialized) profiler::get_instance().pre_block();
-    int result = real::pthread_rwlock_rdlock(rwlock);
-    if(initialized) profiler::get_instance().post_block(true);
+    if(!initialized) return real::pthread_rwlock_rdlock(rwlock);
+
+    int result = real::pthread_rwlock_tryrdlock(rwlock);
+    if(result != EBUSY) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::pthread_rwlock_rdlock(rwlock);
+    profiler::get_instance().post_block(true);
     return result;
   }
 
   int pthread_rwlock_timedrdlock(pthread_rwlock_t* rwlock, const struct timespec* abstime) {
-    if(initialized) profiler::get_instance().pre_block();
-    int result = real::pthread_rwlock_timedrdlock(rwlock, abstime);
-    if(initialized) profiler::get_instance().post_block(result == 0);
+    if(!initialized) return real::pthread_rwlock_timedrdlock(rwlock, abstime);
+
+    int result = real::pthread_rwlock_tryrdlock(rwlock);
+    if(result != EBUSY) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::pthread_rwlock_timedrdlock(rwlock, abstime);
+    profiler::get_instance().post_block(result == 0);
     return result;
   }
 
   int pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) {
-    if(initialized) profiler::get_instance().pre_block();
-    int result = real::pthread_rwlock_wrlock(rwlock);
-    if(initialized) profiler::get_instance().post_block(true);
+    if(!initialized) return real::pthread_rwlock_wrlock(rwlock);
+
+    int result = real::pthread_rwlock_trywrlock(rwlock);
+    if(result != EBUSY) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::pthread_rwlock_wrlock(rwlock);
+    profiler::get_instance().post_block(true);
     return result;
   }
 
   int pthread_rwlock_timedwrlock(pthread_rwlock_t* rwlock, const struct timespec* abstime) {
-    if(initialized) profiler::get_instance().pre_block();
-    int result = real::pthread_rwlock_timedwrlock(rwlock, abstime);
-    if(initialized) profiler::get_instance().post_block(result == 0);
+    if(!initialized) return real::pthread_rwlock_timedwrlock(rwlock, abstime);
+
+    int result = real::pthread_rwlock_trywrlock(rwlock);
+    if(result != EBUSY) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::pthread_rwlock_timedwrlock(rwlock, abstime);
+    profiler::get_instance().post_block(result == 0);
     return result;
   }
 
@@ -505,9 +693,393 @@ extern "C" {
     if(initialized) profiler::get_instance().catch_up();
     return real::pthread_rwlock_unlock(rwlock);
   }
+
+  /**
+   * Blocking I/O. A call that returns because data, a connection or an event arrived was
+   * woken by a writer, so it skips any delays added while it waited. A call that times out
+   * or fails pays them, like a timed wait on a condition variable. Only reads from
+   * sockets, pipes and eventfds are treated as blocking, since file reads do not wait for
+   * another thread. Descriptors in non-blocking mode never wait, so event loops that
+   * read until EAGAIN pay nothing extra.
+   */
+  ssize_t read(int fd, void* buf, size_t count) {
+    if(!initialized || !may_wait(fd)) return real::read(fd, buf, count);
+
+    profiler::get_instance().pre_block();
+    ssize_t result = real::read(fd, buf, count);
+    end_blocking_call(result >= 0);
+    return result;
+  }
+
+  ssize_t recv(int fd, void* buf, size_t len, int flags) {
+    if(!initialized || (flags & MSG_DONTWAIT) || !may_wait(fd)) return real::recv(fd, buf, len, flags);
+
+    profiler::get_instance().pre_block();
+    ssize_t result = real::recv(fd, buf, len, flags);
+    end_blocking_call(result >= 0);
+    return result;
+  }
+
+  ssize_t recvfrom(int fd, void* buf, size_t len, int flags, struct sockaddr* addr, socklen_t* addrlen) {
+    if(!initialized || (flags & MSG_DONTWAIT) || !may_wait(fd)) return real::recvfrom(fd, buf, len, flags, addr, addrlen);
+
+    profiler::get_instance().pre_block();
+    ssize_t result = real::recvfrom(fd, buf, len, flags, addr, addrlen);
+    end_blocking_call(result >= 0);
+    return result;
+  }
+
+  ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+    if(!initialized || (flags & MSG_DONTWAIT) || !may_wait(fd)) return real::recvmsg(fd, msg, flags);
+
+    profiler::get_instance().pre_block();
+    ssize_t result = real::recvmsg(fd, msg, flags);
+    end_blocking_call(result >= 0);
+    return result;
+  }
+
+  int accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+    if(!initialized || !may_wait(fd)) return real::accept(fd, addr, addrlen);
+
+    profiler::get_instance().pre_block();
+    int result = real::accept(fd, addr, addrlen);
+    end_blocking_call(result >= 0);
+    // Accepted sockets do not inherit the listening socket's non-blocking mode
+    set_fd_kind(result, WaitableFd);
+    return result;
+  }
+
+  int accept4(int fd, struct sockaddr* addr, socklen_t* addrlen, int flags) {
+    if(!initialized || !may_wait(fd)) return real::accept4(fd, addr, addrlen, flags);
+
+    profiler::get_instance().pre_block();
+    int result = real::accept4(fd, addr, addrlen, flags);
+    end_blocking_call(result >= 0);
+    set_fd_kind(result, (flags & SOCK_NONBLOCK) ? PlainFd : WaitableFd);
+    return result;
+  }
+
+  /// Forget a descriptor's kind, since its number may be reused for a different file
+  int close(int fd) {
+    set_fd_kind(fd, UnknownFd);
+    return real::close(fd);
+  }
+
+  int dup2(int oldfd, int newfd) {
+    set_fd_kind(newfd, UnknownFd);
+    return real::dup2(oldfd, newfd);
+  }
+
+  int dup3(int oldfd, int newfd, int flags) {
+    set_fd_kind(newfd, UnknownFd);
+    return real::dup3(oldfd, newfd, flags);
+  }
+
+  /// Streams close their descriptors inside libc, without calling close()
+  int fclose(FILE* f) {
+    if(f != nullptr) set_fd_kind(fileno(f), UnknownFd);
+    return real::fclose(f);
+  }
+
+  int pclose(FILE* f) {
+    if(f != nullptr) set_fd_kind(fileno(f), UnknownFd);
+    return real::pclose(f);
+  }
+
+#ifdef COZ_HAVE_CLOSE_RANGE
+  int close_range(unsigned int first, unsigned int last, int flags) {
+    forget_fds(first, last);
+    return real::close_range(first, last, flags);
+  }
+
+  void closefrom(int lowfd) {
+    forget_fds(lowfd < 0 ? 0 : lowfd, FdKindCacheSize - 1);
+    real::closefrom(lowfd);
+  }
+#endif
+
+  /// Forget a descriptor's kind when its blocking mode may change. No command takes
+  /// more than one argument.
+  int fcntl(int fd, int cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    if(cmd == F_SETFL) set_fd_kind(fd, UnknownFd);
+    return real::fcntl(fd, cmd, arg);
+  }
+
+#ifdef COZ_HAVE_FCNTL64
+  int fcntl64(int fd, int cmd, ...) {
+    va_list args;
+    va_start(args, cmd);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    if(cmd == F_SETFL) set_fd_kind(fd, UnknownFd);
+    return real::fcntl64(fd, cmd, arg);
+  }
+#endif
+
+  int ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    if(request == FIONBIO) set_fd_kind(fd, UnknownFd);
+    return real::ioctl(fd, request, arg);
+  }
+
+  /// Wait for events. Skip delays if events arrived, but not after a timeout. Polls return at once.
+  int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+    if(!initialized || timeout == 0) return real::poll(fds, nfds, timeout);
+
+    profiler::get_instance().pre_block();
+    int result = real::poll(fds, nfds, timeout);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  int ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout, const sigset_t* sigmask) {
+    if(!initialized || (timeout != nullptr && timeout->tv_sec == 0 && timeout->tv_nsec == 0))
+      return real::ppoll(fds, nfds, timeout, sigmask);
+
+    profiler::get_instance().pre_block();
+    int result = real::ppoll(fds, nfds, timeout, sigmask);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) {
+    if(!initialized || (timeout != nullptr && timeout->tv_sec == 0 && timeout->tv_usec == 0))
+      return real::select(nfds, readfds, writefds, exceptfds, timeout);
+
+    profiler::get_instance().pre_block();
+    int result = real::select(nfds, readfds, writefds, exceptfds, timeout);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  int pselect(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
+              const struct timespec* timeout, const sigset_t* sigmask) {
+    if(!initialized || (timeout != nullptr && timeout->tv_sec == 0 && timeout->tv_nsec == 0))
+      return real::pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+
+    profiler::get_instance().pre_block();
+    int result = real::pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    if(!initialized || timeout == 0) return real::epoll_wait(epfd, events, maxevents, timeout);
+
+    profiler::get_instance().pre_block();
+    int result = real::epoll_wait(epfd, events, maxevents, timeout);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  int epoll_pwait(int epfd, struct epoll_event* events, int maxevents, int timeout, const sigset_t* sigmask) {
+    if(!initialized || timeout == 0) return real::epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+
+    profiler::get_instance().pre_block();
+    int result = real::epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+    end_blocking_call(result > 0);
+    return result;
+  }
+
+  /**
+   * Sleeping threads are blocked, so they are not interrupted to pay delays. No other thread
+   * wakes a sleep, so delays added while sleeping are paid on wake-up.
+   */
+  int nanosleep(const struct timespec* req, struct timespec* rem) {
+    if(!initialized) return real::nanosleep(req, rem);
+
+    profiler::get_instance().pre_block();
+    int result = real::nanosleep(req, rem);
+    end_blocking_call(false);
+    return result;
+  }
+
+  int clock_nanosleep(clockid_t clock, int flags, const struct timespec* req, struct timespec* rem) {
+    if(!initialized) return real::clock_nanosleep(clock, flags, req, rem);
+
+    profiler::get_instance().pre_block();
+    int result = real::clock_nanosleep(clock, flags, req, rem);
+    end_blocking_call(false);
+    return result;
+  }
+
+  int usleep(useconds_t usec) {
+    if(!initialized) return real::usleep(usec);
+
+    profiler::get_instance().pre_block();
+    int result = real::usleep(usec);
+    end_blocking_call(false);
+    return result;
+  }
+
+  unsigned int sleep(unsigned int seconds) {
+    if(!initialized) return real::sleep(seconds);
+
+    profiler::get_instance().pre_block();
+    unsigned int result = real::sleep(seconds);
+    end_blocking_call(false);
+    return result;
+  }
+
+  /// Skip delays added while waiting on a semaphore. As with mutexes, try it first.
+  int sem_wait(sem_t* sem) {
+    if(!initialized) return real::sem_wait(sem);
+
+    int result = real::sem_trywait(sem);
+    if(result == 0 || errno != EAGAIN) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::sem_wait(sem);
+    end_blocking_call(result == 0);
+    return result;
+  }
+
+  /// Skip delays added while waiting on a semaphore, unless the wait timed out
+  int sem_timedwait(sem_t* sem, const struct timespec* abstime) {
+    if(!initialized) return real::sem_timedwait(sem, abstime);
+
+    int result = real::sem_trywait(sem);
+    if(result == 0 || errno != EAGAIN) return result;
+
+    profiler::get_instance().pre_block();
+    result = real::sem_timedwait(sem, abstime);
+    end_blocking_call(result == 0);
+    return result;
+  }
+
+  /// Catch up on delays before waking a thread waiting on a semaphore
+  int sem_post(sem_t* sem) {
+    if(initialized) profiler::get_instance().catch_up();
+    return real::sem_post(sem);
+  }
+
+  /**
+   * Handle raw futex calls, which std::atomic::wait, C++20 semaphores and many user-space
+   * mutexes make instead of calling into pthreads. A wait that returns 0 was woken by
+   * another thread and skips delays; one that times out, is interrupted or finds the value
+   * already changed does not. Priority-inheritance locks are handled the same way, since
+   * user space only makes the call when the lock is contended. Wakers catch up first, like
+   * pthread_cond_signal. All other system calls are passed through. syscall() is variadic,
+   * so pass on the most arguments any system call takes.
+   *
+   * This is only an approximation of who woke the thread. The kernel can also return 0
+   * from a wait that no thread woke, and such a spurious wakeup skips delays like a real
+   * one. Waits on several futexes with futex_waitv are a separate system call, and are not
+   * counted as blocking.
+   */
+  long syscall(long number, ...) {
+    va_list args;
+    va_start(args, number);
+    long a1 = va_arg(args, long);
+    long a2 = va_arg(args, long);
+    long a3 = va_arg(args, long);
+    long a4 = va_arg(args, long);
+    long a5 = va_arg(args, long);
+    long a6 = va_arg(args, long);
+    va_end(args);
+
+    // Descriptors closed or replaced without the wrappers above must be forgotten too
+    switch(number) {
+    case SYS_close:
+      set_fd_kind(static_cast<int>(a1), UnknownFd);
+      break;
+#ifdef SYS_dup2
+    case SYS_dup2:
+#endif
+    case SYS_dup3:
+      set_fd_kind(static_cast<int>(a2), UnknownFd);
+      break;
+#ifdef SYS_close_range
+    case SYS_close_range:
+      forget_fds(static_cast<unsigned int>(a1), static_cast<unsigned int>(a2));
+      break;
+#endif
+    case SYS_fcntl:
+      if(static_cast<int>(a2) == F_SETFL) set_fd_kind(static_cast<int>(a1), UnknownFd);
+      break;
+    }
+
+    if(number != SYS_futex || !initialized)
+      return real::syscall(number, a1, a2, a3, a4, a5, a6);
+
+    switch(static_cast<int>(a2) & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+    case FUTEX_WAIT_REQUEUE_PI:
+    case FUTEX_LOCK_PI:
+#ifdef FUTEX_LOCK_PI2
+    case FUTEX_LOCK_PI2:
+#endif
+    {
+      profiler::get_instance().pre_block();
+      long result = real::syscall(number, a1, a2, a3, a4, a5, a6);
+      end_blocking_call(result == 0);
+      return result;
+    }
+
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET:
+    case FUTEX_WAKE_OP:
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+    case FUTEX_CMP_REQUEUE_PI:
+    case FUTEX_UNLOCK_PI:
+      profiler::get_instance().catch_up();
+      return real::syscall(number, a1, a2, a3, a4, a5, a6);
+
+    default:
+      return real::syscall(number, a1, a2, a3, a4, a5, a6);
+    }
+  }
 #endif // !__APPLE__
 
 #ifndef __APPLE__
+  /**
+   * Fork with no coz lock held by another thread, then profile the child on its own,
+   * with output to a file named for its PID
+   */
+  pid_t fork() {
+    if(!initialized) return real::fork();
+
+    profiler::get_instance().before_fork();
+    pid_t pid = real::fork();
+    profiler::get_instance().after_fork(pid == 0);
+    return pid;
+  }
+
+  /// Keep coz loaded in the new program when following exec
+  int execve(const char* path, char* const argv[], char* const envp[]) {
+    vector<char*> merged;
+    return real::execve(path, argv, add_coz_env(envp, merged));
+  }
+
+  /// Keep coz loaded in the spawned program when following exec
+  int posix_spawn(pid_t* pid, const char* path,
+                  const posix_spawn_file_actions_t* file_actions,
+                  const posix_spawnattr_t* attrp,
+                  char* const argv[], char* const envp[]) {
+    vector<char*> merged;
+    return real::posix_spawn(pid, path, file_actions, attrp, argv, add_coz_env(envp, merged));
+  }
+
+  int posix_spawnp(pid_t* pid, const char* file,
+                   const posix_spawn_file_actions_t* file_actions,
+                   const posix_spawnattr_t* attrp,
+                   char* const argv[], char* const envp[]) {
+    vector<char*> merged;
+    return real::posix_spawnp(pid, file, file_actions, attrp, argv, add_coz_env(envp, merged));
+  }
+
   /// Run shutdown before exiting
   void __attribute__((noreturn)) exit(int status) {
     profiler::get_instance().shutdown();
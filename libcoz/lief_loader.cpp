@@ -20,9 +20,14 @@
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifndef __APPLE__
+#include <elf.h>
+#endif
+
 #include <iostream>  // Debug
 
 #ifdef __APPLE__
@@ -241,29 +246,6 @@ std::string basename_of(const std::string& path) {
 #ifndef __APPLE__
 // ============== Linux-specific debug file lookup ==============
 
-/**
- * Extract build-id from an ELF binary using LIEF.
- * Returns hex string of build-id, or empty string if not found.
- */
-std::string extract_build_id(LIEF::ELF::Binary* elf) {
-  // Look for GNU build-id note
-  for (const auto& note : elf->notes()) {
-    if (note.type() == LIEF::ELF::Note::TYPE::GNU_BUILD_ID) {
-      auto desc = note.description();
-      if (desc.empty())
-        continue;
-
-      // Convert to hex string
-      std::ostringstream ss;
-      for (uint8_t byte : desc) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
-      }
-      return ss.str();
-    }
-  }
-  return std::string();
-}
-
 /**
  * Extract .gnu_debuglink filename from an ELF binary.
  * Returns the debug file name, or empty string if not found.
@@ -289,11 +271,12 @@ std::string find_debug_file(LIEF::ELF::Binary* elf, const std::string& binary_pa
   std::vector<std::string> search_paths;
   std::string directory = dirname_of(binary_path);
 
-  // 1. Try build-id based lookup first (most reliable)
-  std::string build_id = extract_build_id(elf);
-  if (build_id.length() >= 3) {
-    std::string prefix = build_id.substr(0, 2);
-    std::string suffix = build_id.substr(2);
+  // 1. Try build-id based lookup first (most reliable). The line map cache reads the
+  // build-id the same way, without a LIEF parse, so both agree on a binary's identity.
+  std::string id = build_id(binary_path);
+  if (id.length() >= 3) {
+    std::string prefix = id.substr(0, 2);
+    std::string suffix = id.substr(2);
     search_paths.push_back("/usr/lib/debug/.build-id/" + prefix + "/" + suffix + ".debug");
   }
 
@@ -452,6 +435,95 @@ bool is_static_executable(const std::string& path) {
 #endif
 }
 
+#ifndef __APPLE__
+namespace {
+
+/// Scan an ELF file's note segments for the GNU build-id, reading only the headers and notes
+template<typename Ehdr, typename Phdr, typename Nhdr>
+std::string read_elf_build_id(int fd) {
+  Ehdr header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    return std::string();
+
+  for (size_t i = 0; i < header.e_phnum; i++) {
+    Phdr ph;
+    off_t offset = header.e_phoff + i * header.e_phentsize;
+    if (pread(fd, &ph, sizeof(ph), offset) != sizeof(ph))
+      return std::string();
+    if (ph.p_type != PT_NOTE || ph.p_filesz == 0 || ph.p_filesz > (1 << 20))
+      continue;
+
+    std::vector<uint8_t> notes(ph.p_filesz);
+    if (pread(fd, notes.data(), notes.size(), ph.p_offset) != static_cast<ssize_t>(notes.size()))
+      continue;
+
+    size_t pos = 0;
+    while (pos + sizeof(Nhdr) <= notes.size()) {
+      Nhdr note;
+      memcpy(&note, &notes[pos], sizeof(note));
+      size_t name_pos = pos + sizeof(Nhdr);
+      size_t desc_pos = name_pos + ((note.n_namesz + 3) & ~3);
+      size_t next = desc_pos + ((note.n_descsz + 3) & ~3);
+      if (next > notes.size())
+        break;
+
+      if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == 4 &&
+          memcmp(&notes[name_pos], "GNU", 4) == 0) {
+        std::ostringstream ss;
+        for (size_t j = 0; j < note.n_descsz; j++) {
+          ss << std::hex << std::setw(2) << std::setfill('0')
+             << static_cast<int>(notes[desc_pos + j]);
+        }
+        return ss.str();
+      }
+      pos = next;
+    }
+  }
+  return std::string();
+}
+
+} // namespace
+#endif
+
+std::string build_id(const std::string& path) {
+#ifdef __APPLE__
+  // Mach-O binaries carry a UUID load command that serves the same purpose
+  try {
+    auto fat_binary = LIEF::MachO::Parser::parse(path);
+    if (!fat_binary || fat_binary->empty())
+      return std::string();
+    LIEF::MachO::Binary* macho = fat_binary->at(0);
+    if (!macho || !macho->has_uuid())
+      return std::string();
+    std::ostringstream ss;
+    for (uint8_t byte : macho->uuid()->uuid()) {
+      ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+    }
+    return ss.str();
+  } catch (const std::exception& e) {
+    return std::string();
+  }
+#else
+  // Avoid a full LIEF parse here: this runs before the line map cache is consulted
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return std::string();
+
+  std::string result;
+  unsigned char ident[EI_NIDENT];
+  if (pread(fd, ident, sizeof(ident), 0) == sizeof(ident) &&
+      memcmp(ident, ELFMAG, SELFMAG) == 0) {
+    if (ident[EI_CLASS] == ELFCLASS64) {
+      result = read_elf_build_id<Elf64_Ehdr, Elf64_Phdr, Elf64_Nhdr>(fd);
+    } else if (ident[EI_CLASS] == ELFCLASS32) {
+      result = read_elf_build_id<Elf32_Ehdr, Elf32_Phdr, Elf32_Nhdr>(fd);
+    }
+  }
+  close(fd);
+  return result;
+#endif
+}
+
 std::shared_ptr<dwarf::loader> load(const std::string& path) {
 #if LIEF_LOADER_DEBUG
   std::cerr << "[lief_loader] Loading: " << path << std::endl;
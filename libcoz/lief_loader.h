@@ -54,6 +54,13 @@ std::string generate_dsym(const std::string& binary_path);
  */
 bool is_static_executable(const std::string& path);
 
+/**
+ * Get a hex string that uniquely identifies a binary's contents: the GNU build-id
+ * note on Linux, or the LC_UUID load command on macOS.
+ * Returns an empty string if the binary has neither.
+ */
+std::string build_id(const std::string& path);
+
 } // namespace lief_loader
 
 #endif // COZ_LIEF_LOADER_H
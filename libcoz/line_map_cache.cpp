@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#include "line_map_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "lief_loader.h"
+
+#include "ccutil/log.h"
+
+using namespace std;
+
+namespace {
+  enum {
+    CacheVersion = 1  //< Bump whenever the entry layout or the ranges it records change
+  };
+
+  const char CacheMagic[8] = {'C', 'O', 'Z', 'L', 'I', 'N', 'E', 'S'};
+
+  /**
+   * Layout of a cache entry: this header, then range_count debug_range records,
+   * then file_count end offsets into the string data, then the string data itself.
+   */
+  struct entry_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t range_size;    //< sizeof(debug_range) on the host that wrote the entry
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t file_count;
+    uint64_t range_count;
+    uint64_t string_size;
+  };
+
+  enum {
+    StaticFlag = 1  //< The binary is loaded at its link-time addresses
+  };
+
+  /// 64-bit FNV-1a, used to fold settings into a short file name component
+  uint64_t fnv1a(uint64_t h, const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for(size_t i = 0; i < len; i++) {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  /// Create a directory and any missing parents
+  bool make_directories(const string& path) {
+    for(size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+      string prefix = path.substr(0, pos);
+      if(mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+      if(pos == string::npos)
+        return true;
+    }
+  }
+
+  /// Read exactly len bytes at an offset. Returns false on an error or a short file.
+  bool read_all(int fd, void* data, size_t len, off_t offset) {
+    char* p = static_cast<char*>(data);
+    while(len > 0) {
+      ssize_t n = pread(fd, p, len, offset);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      p += n;
+      len -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  bool write_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while(len > 0) {
+      ssize_t n = write(fd, p, len);
+      if(n < 0) {
+        if(errno == EINTR)
+          continue;
+        return false;
+      }
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+}
+
+namespace line_map_cache {
+  string settings_key(const unordered_set<string>& source_scope, bool allow_system_sources) {
+    // Sort the patterns so the key does not depend on hash set iteration order
+    vector<string> patterns(source_scope.begin(), source_scope.end());
+    sort(patterns.begin(), patterns.end());
+
+    uint64_t h = 14695981039346656037ULL;
+    uint32_t version = CacheVersion;
+    h = fnv1a(h, &version, sizeof(version));
+    h = fnv1a(h, &allow_system_sources, sizeof(allow_system_sources));
+    for(const string& p : patterns) {
+      h = fnv1a(h, p.c_str(), p.size() + 1);
+    }
+
+    // Relative paths in debug information are resolved against the working directory
+    char* cwd = getcwd(NULL, 0);
+    if(cwd != NULL) {
+      h = fnv1a(h, cwd, strlen(cwd));
+      free(cwd);
+    }
+
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    return string(buf);
+  }
+
+  string entry_path(const string& cache_dir, const string& binary, const string& settings_key) {
+    string id = lief_loader::build_id(binary);
+    if(id.empty())
+      return string();
+    return cache_dir + "/" + id + "-" + settings_key + ".lines";
+  }
+
+  bool load(const string& path, memory_map::debug_info& info) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+      return false;
+
+    struct stat st;
+    entry_header header;
+    if(fstat(fd, &st) != 0 || !read_all(fd, &header, sizeof(header), 0)) {
+      close(fd);
+      return false;
+    }
+
+    bool valid = memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) == 0 &&
+                 header.version == CacheVersion &&
+                 header.range_size == sizeof(memory_map::debug_range) &&
+                 static_cast<size_t>(st.st_size) >= sizeof(header);
+
+    // Fit each section into what is left of the file in turn, so corrupt counts can
+    // never wrap around to a total that matches the file's size
+    size_t remaining = valid ? st.st_size - sizeof(header) : 0;
+    valid = valid && header.range_count <= remaining / sizeof(memory_map::debug_range);
+    if(valid) remaining -= header.range_count * sizeof(memory_map::debug_range);
+    valid = valid && header.file_count <= remaining / sizeof(uint64_t);
+    if(valid) remaining -= header.file_count * sizeof(uint64_t);
+    valid = valid && header.string_size == remaining;
+
+    // Read each section straight into its final place
+    vector<uint64_t> offsets;
+    string strings;
+    if(valid) {
+      size_t ranges_size = header.range_count * sizeof(memory_map::debug_range);
+      size_t offsets_size = header.file_count * sizeof(uint64_t);
+      info.ranges.resize(header.range_count);
+      offsets.resize(header.file_count);
+      strings.resize(header.string_size);
+      valid = read_all(fd, info.ranges.data(), ranges_size, sizeof(header)) &&
+              read_all(fd, offsets.data(), offsets_size, sizeof(header) + ranges_size) &&
+              read_all(fd, &strings[0], strings.size(), sizeof(header) + ranges_size + offsets_size);
+    }
+    close(fd);
+
+    if(valid) {
+      info.files.clear();
+      info.files.reserve(header.file_count);
+      uint64_t start = 0;
+      for(uint64_t end : offsets) {
+        if(end < start || end > header.string_size) {
+          valid = false;
+          break;
+        }
+        info.files.emplace_back(strings, start, end - start);
+        start = end;
+      }
+    }
+
+    if(valid) {
+      for(const auto& r : info.ranges) {
+        if(r.file >= header.file_count) {
+          valid = false;
+          break;
+        }
+      }
+      info.is_static = header.flags & StaticFlag;
+    }
+
+    if(!valid) {
+      info.files.clear();
+      info.ranges.clear();
+      VERBOSE << "Ignoring invalid line map cache entry " << path;
+    }
+    return valid;
+  }
+
+  bool store(const string& path, const memory_map::debug_info& info) {
+    string dir = path.substr(0, path.rfind('/'));
+    if(!make_directories(dir)) {
+      WARNING << "Unable to create line map cache directory " << dir;
+      return false;
+    }
+
+    entry_header header;
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.range_size = sizeof(memory_map::debug_range);
+    header.flags = info.is_static ? StaticFlag : 0;
+    header.reserved = 0;
+    header.file_count = info.files.size();
+    header.range_count = info.ranges.size();
+
+    vector<uint64_t> offsets;
+    string strings;
+    for(const string& f : info.files) {
+      strings += f;
+      offsets.push_back(strings.size());
+    }
+    header.string_size = strings.size();
+
+    // Write to a private temporary file and rename it into place
+    stringstream tmp;
+    tmp << path << ".tmp." << getpid() << "." << pthread_self();
+    string tmp_path = tmp.str();
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) {
+      WARNING << "Unable to write line map cache entry " << path;
+      return false;
+    }
+
+    bool ok = write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, info.ranges.data(), info.ranges.size() * sizeof(memory_map::debug_range)) &&
+              write_all(fd, offsets.data(), offsets.size() * sizeof(uint64_t)) &&
+              write_all(fd, strings.data(), strings.size());
+    ok = (close(fd) == 0) && ok;
+
+    if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      WARNING << "Unable to write line map cache entry " << path;
+      return false;
+    }
+    return true;
+  }
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_LINE_MAP_CACHE_H)
+#define CAUSAL_RUNTIME_LINE_MAP_CACHE_H
+
+#include <string>
+#include <unordered_set>
+
+#include "inspect.h"
+
+/**
+ * An on-disk cache of the line maps built from each binary's debug information.
+ * Entries are keyed by the binary's build-id and a hash of the settings that
+ * affect which ranges are kept, so a cached map is only reused for exactly the
+ * same code. Each entry is a single file whose ranges are read straight into the
+ * line map, with no parsing.
+ */
+namespace line_map_cache {
+  /// Hash the settings that change the contents of a line map
+  std::string settings_key(const std::unordered_set<std::string>& source_scope,
+                           bool allow_system_sources);
+
+  /// Get the path of the cache entry for a binary, or an empty string if it cannot be cached
+  std::string entry_path(const std::string& cache_dir,
+                         const std::string& binary,
+                         const std::string& settings_key);
+
+  /// Load a cache entry. Returns false if it is missing, truncated, or from another version.
+  bool load(const std::string& path, memory_map::debug_info& info);
+
+  /// Write a cache entry. The file is replaced atomically, so concurrent runs never see partial entries.
+  bool store(const std::string& path, const memory_map::debug_info& info);
+}
+
+#endif
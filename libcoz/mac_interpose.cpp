@@ -7,6 +7,7 @@
 
 #ifdef __APPLE__
 
+#include <errno.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -125,8 +126,11 @@ DYLD_INTERPOSE(coz_pthread_join, pthread_join);
 // ============================================================================
 // Mutex wrappers
 // ============================================================================
+// Only an acquire that has to wait is treated as blocking; see libcoz.cpp
 int coz_pthread_mutex_lock(pthread_mutex_t* mutex) {
   if (!coz_initialized()) return orig_pthread_mutex_lock(mutex);
+  int fast = pthread_mutex_trylock(mutex);
+  if (fast != EBUSY) return fast;
   coz_pre_block();
   int result = orig_pthread_mutex_lock(mutex);
   coz_post_block(true);
@@ -179,6 +183,8 @@ DYLD_INTERPOSE(coz_pthread_cond_broadcast, pthread_cond_broadcast);
 // ============================================================================
 int coz_pthread_rwlock_rdlock(pthread_rwlock_t* rwlock) {
   if (!coz_initialized()) return orig_pthread_rwlock_rdlock(rwlock);
+  int fast = pthread_rwlock_tryrdlock(rwlock);
+  if (fast != EBUSY) return fast;
   coz_pre_block();
   int result = orig_pthread_rwlock_rdlock(rwlock);
   coz_post_block(true);
@@ -188,6 +194,8 @@ DYLD_INTERPOSE(coz_pthread_rwlock_rdlock, pthread_rwlock_rdlock);
 
 int coz_pthread_rwlock_wrlock(pthread_rwlock_t* rwlock) {
   if (!coz_initialized()) return orig_pthread_rwlock_wrlock(rwlock);
+  int fast = pthread_rwlock_trywrlock(rwlock);
+  if (fast != EBUSY) return fast;
   coz_pre_block();
   int result = orig_pthread_rwlock_wrlock(rwlock);
   coz_post_block(true);
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+/**
+ * An OpenMP tool (OMPT) that tells the profiler when OpenMP threads wait. OpenMP
+ * runtimes spin and sleep inside barriers, taskwaits, and locks without calling
+ * any of the pthread functions coz wraps, so without these callbacks a thread
+ * waiting at a barrier would be charged every delay inserted while it waited.
+ *
+ * Runtimes that support OMPT (such as LLVM's libomp) look for ompt_start_tool
+ * when they start. GCC's libgomp does not, so programs built with GCC must run
+ * with libomp to benefit. Set OMP_TOOL=disabled to turn the tool off.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "inspect.h"
+#include "profiler.h"
+#include "progress_point.h"
+
+#include "ccutil/log.h"
+#include "ccutil/spinlock.h"
+
+/// Set once the profiler has started (defined in libcoz.cpp)
+extern bool initialized;
+
+/*
+ * The subset of the OMPT interface from omp-tools.h used here. The header only
+ * ships with some compilers, but the interface is a stable C ABI, so the types
+ * and constants are declared directly.
+ */
+extern "C" {
+  typedef union ompt_data_t {
+    uint64_t value;
+    void* ptr;
+  } ompt_data_t;
+
+  typedef void (*ompt_interface_fn_t)(void);
+  typedef ompt_interface_fn_t (*ompt_function_lookup_t)(const char* interface_function_name);
+  typedef void (*ompt_callback_t)(void);
+  typedef int (*ompt_initialize_t)(ompt_function_lookup_t lookup,
+                                   int initial_device_num,
+                                   ompt_data_t* tool_data);
+  typedef void (*ompt_finalize_t)(ompt_data_t* tool_data);
+  typedef int (*ompt_set_callback_t)(int event, ompt_callback_t callback);
+
+  typedef struct ompt_start_tool_result_t {
+    ompt_initialize_t initialize;
+    ompt_finalize_t finalize;
+    ompt_data_t tool_data;
+  } ompt_start_tool_result_t;
+
+  typedef uint64_t ompt_wait_id_t;
+  struct ompt_frame_t;
+}
+
+enum {
+  ompt_callback_parallel_begin = 3,
+  ompt_callback_parallel_end = 4,
+  ompt_callback_task_schedule = 6,
+  ompt_callback_sync_region_wait = 16,
+  ompt_callback_mutex_released = 17,
+  ompt_callback_sync_region = 23,
+  ompt_callback_mutex_acquire = 26,
+  ompt_callback_mutex_acquired = 27,
+  ompt_callback_nest_lock = 28
+};
+
+enum {
+  ompt_set_error = 0,
+  ompt_set_never = 1
+};
+
+enum {
+  ompt_scope_begin = 1,
+  ompt_scope_end = 2,
+  ompt_scope_beginend = 3
+};
+
+enum {
+  ompt_task_complete = 1,
+  ompt_task_yield = 2,
+  ompt_task_cancel = 3,
+  ompt_task_detach = 4,
+  ompt_task_early_fulfill = 5,
+  ompt_task_late_fulfill = 6,
+  ompt_task_switch = 7
+};
+
+enum {
+  ompt_mutex_lock = 1,
+  ompt_mutex_test_lock = 2,
+  ompt_mutex_nest_lock = 3,
+  ompt_mutex_test_nest_lock = 4,
+  ompt_mutex_critical = 5,
+  ompt_mutex_atomic = 6,
+  ompt_mutex_ordered = 7
+};
+
+enum {
+  MaxNesting = 64   //< Waits and tasks tracked per thread; deeper nesting counts as running
+};
+
+/**
+ * Each thread keeps a stack of the waits it is in and the tasks it runs while
+ * waiting, since OpenMP threads execute queued tasks at barriers and taskwaits.
+ * The thread is blocked whenever the innermost entry is a wait.
+ */
+struct ompt_thread_state {
+  uint64_t wait_mask;   //< Bit i is set if entry i of the stack is a wait
+  size_t depth;         //< Number of entries on the stack
+  bool blocked;         //< Set while the profiler considers this thread blocked
+  bool lock_wait;       //< Set while this thread waits for a lock
+};
+
+static __thread ompt_thread_state _ompt_state COZ_INITIAL_EXEC_TLS;
+
+static bool _regions = false;                                     //< Count parallel regions as latency progress points
+static spinlock _region_points_lock;                              //< Protects the region point cache
+static std::unordered_map<const void*, latency_point*>* _region_points = nullptr;
+
+/// Mark this thread blocked if it is not already
+static void begin_wait() {
+  if(!_ompt_state.blocked) {
+    profiler::get_instance().pre_block();
+    _ompt_state.blocked = true;
+  }
+}
+
+/// Mark this thread running again. Waits always end because of another thread.
+static void end_wait() {
+  if(_ompt_state.blocked) {
+    profiler::get_instance().post_block(true);
+    _ompt_state.blocked = false;
+  }
+}
+
+static bool innermost_is_wait() {
+  size_t depth = _ompt_state.depth;
+  return depth > 0 && depth <= MaxNesting && (_ompt_state.wait_mask & (1ULL << (depth - 1)));
+}
+
+static void push(bool is_wait) {
+  size_t depth = _ompt_state.depth;
+  if(depth < MaxNesting) {
+    uint64_t bit = 1ULL << depth;
+    _ompt_state.wait_mask = is_wait ? (_ompt_state.wait_mask | bit) : (_ompt_state.wait_mask & ~bit);
+  }
+  _ompt_state.depth = depth + 1;
+}
+
+static void pop() {
+  if(_ompt_state.depth > 0) _ompt_state.depth--;
+}
+
+/// Block or unblock this thread to match the innermost entry of its stack
+static void update() {
+  if(innermost_is_wait()) {
+    begin_wait();
+  } else if(!_ompt_state.lock_wait) {
+    end_wait();
+  }
+}
+
+static void on_sync_region(int kind, int endpoint, ompt_data_t* parallel_data,
+                           ompt_data_t* task_data, const void* codeptr_ra) {
+  // Arriving at a barrier or taskwait may release other threads
+  if(initialized && endpoint != ompt_scope_end) {
+    profiler::get_instance().catch_up();
+  }
+}
+
+static void on_sync_region_wait(int kind, int endpoint, ompt_data_t* parallel_data,
+                                ompt_data_t* task_data, const void* codeptr_ra) {
+  if(!initialized || endpoint == ompt_scope_beginend) return;
+
+  if(endpoint == ompt_scope_begin) {
+    push(true);
+  } else if(innermost_is_wait() || _ompt_state.depth > MaxNesting) {
+    pop();
+  }
+  update();
+}
+
+static void on_task_schedule(ompt_data_t* prior_task_data, int prior_task_status,
+                             ompt_data_t* next_task_data) {
+  if(!initialized) return;
+
+  switch(prior_task_status) {
+    case ompt_task_switch:
+    case ompt_task_yield:
+      // Only tasks run during a wait change whether this thread is blocked
+      if(_ompt_state.depth > 0) push(false);
+      break;
+
+    case ompt_task_complete:
+    case ompt_task_cancel:
+    case ompt_task_detach:
+      // Finishing a task may release threads waiting on it or its dependences
+      profiler::get_instance().catch_up();
+      if(_ompt_state.depth > 0 && !innermost_is_wait()) pop();
+      break;
+
+    case ompt_task_early_fulfill:
+    case ompt_task_late_fulfill:
+      profiler::get_instance().catch_up();
+      return;
+
+    default:
+      return;
+  }
+  update();
+}
+
+static void on_mutex_acquire(int kind, unsigned int hint, unsigned int impl,
+                             ompt_wait_id_t wait_id, const void* codeptr_ra) {
+  // Atomics and lock tests never wait
+  if(!initialized || kind == ompt_mutex_atomic ||
+     kind == ompt_mutex_test_lock || kind == ompt_mutex_test_nest_lock) return;
+
+  _ompt_state.lock_wait = true;
+  begin_wait();
+}
+
+static void on_mutex_acquired(int kind, ompt_wait_id_t wait_id, const void* codeptr_ra) {
+  if(_ompt_state.lock_wait) {
+    _ompt_state.lock_wait = false;
+    update();
+  }
+}
+
+static void on_nest_lock(int endpoint, ompt_wait_id_t wait_id, const void* codeptr_ra) {
+  // Acquiring a nested lock the thread already holds is reported here instead
+  if(endpoint == ompt_scope_begin) {
+    on_mutex_acquired(ompt_mutex_nest_lock, wait_id, codeptr_ra);
+  }
+}
+
+static void on_mutex_released(int kind, ompt_wait_id_t wait_id, const void* codeptr_ra) {
+  // Releasing a lock may wake a thread waiting for it
+  if(initialized && kind != ompt_mutex_atomic) {
+    profiler::get_instance().catch_up();
+  }
+}
+
+/// Get the latency point for the parallel region that starts at a return address
+static latency_point* get_region_point(const void* codeptr_ra) {
+  _region_points_lock.lock();
+  auto search = _region_points->find(codeptr_ra);
+  latency_point* result = search == _region_points->end() ? nullptr : search->second;
+  _region_points_lock.unlock();
+  if(result != nullptr) return result;
+
+  // Name the region after the source line of the call that starts it
+  std::stringstream name;
+  name << "omp parallel ";
+  line* l = memory_map::get_instance().find_line(reinterpret_cast<uintptr_t>(codeptr_ra) - 1);
+  if(l != nullptr) {
+    name << l;
+  } else {
+    name << std::hex << "0x" << reinterpret_cast<uintptr_t>(codeptr_ra);
+  }
+  result = profiler::get_instance().get_latency_point(name.str());
+
+  _region_points_lock.lock();
+  _region_points->emplace(codeptr_ra, result);
+  _region_points_lock.unlock();
+  return result;
+}
+
+static void on_parallel_begin(ompt_data_t* encountering_task_data,
+                              const ompt_frame_t* encountering_task_frame,
+                              ompt_data_t* parallel_data,
+                              unsigned int requested_parallelism,
+                              int flags, const void* codeptr_ra) {
+  latency_point* p = nullptr;
+  if(initialized && codeptr_ra != nullptr) {
+    p = get_region_point(codeptr_ra);
+    p->visit_begin();
+  }
+  parallel_data->ptr = p;
+}
+
+static void on_parallel_end(ompt_data_t* parallel_data, ompt_data_t* encountering_task_data,
+                            int flags, const void* codeptr_ra) {
+  latency_point* p = static_cast<latency_point*>(parallel_data->ptr);
+  if(p != nullptr) {
+    p->visit_end();
+  }
+}
+
+/// Register a callback, logging callbacks the runtime does not support
+static void set_callback(ompt_set_callback_t set, int event, ompt_callback_t fn, const char* name) {
+  int result = set(event, fn);
+  if(result == ompt_set_error || result == ompt_set_never) {
+    VERBOSE << "OpenMP runtime does not support the " << name << " callback";
+  }
+}
+
+#define SET_CALLBACK(set, event, fn) \
+  set_callback(set, ompt_callback_##event, reinterpret_cast<ompt_callback_t>(fn), #event)
+
+static int ompt_initialize(ompt_function_lookup_t lookup, int initial_device_num,
+                           ompt_data_t* tool_data) {
+  ompt_set_callback_t set = reinterpret_cast<ompt_set_callback_t>(lookup("ompt_set_callback"));
+  if(set == nullptr) {
+    WARNING << "Unable to register OpenMP callbacks";
+    return 0;
+  }
+
+  SET_CALLBACK(set, sync_region, on_sync_region);
+  SET_CALLBACK(set, sync_region_wait, on_sync_region_wait);
+  SET_CALLBACK(set, task_schedule, on_task_schedule);
+  SET_CALLBACK(set, mutex_acquire, on_mutex_acquire);
+  SET_CALLBACK(set, mutex_acquired, on_mutex_acquired);
+  SET_CALLBACK(set, nest_lock, on_nest_lock);
+  SET_CALLBACK(set, mutex_released, on_mutex_released);
+
+  if(_regions) {
+    _region_points = new std::unordered_map<const void*, latency_point*>();
+    SET_CALLBACK(set, parallel_begin, on_parallel_begin);
+    SET_CALLBACK(set, parallel_end, on_parallel_end);
+  }
+
+  // Keep the tool active
+  return 1;
+}
+
+static void ompt_finalize(ompt_data_t* tool_data) {}
+
+/**
+ * Called by the OpenMP runtime when it starts, which may be before coz has
+ * initialized. Returning a tool makes the runtime call ompt_initialize.
+ */
+extern "C" ompt_start_tool_result_t* ompt_start_tool(unsigned int omp_version,
+                                                     const char* runtime_version) {
+  static ompt_start_tool_result_t result = { ompt_initialize, ompt_finalize, { 0 } };
+  _regions = getenv("COZ_OMPT_REGIONS");
+  VERBOSE << "Registering OMPT tool with " << runtime_version;
+  return &result;
+}
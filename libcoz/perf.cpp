@@ -33,10 +33,8 @@
 using ccutil::wrapped_array;
 
 enum {
-  DataPages = 2,
   PageSize = 0x1000,
-  DataSize = DataPages * PageSize,
-  MmapSize = DataSize + PageSize
+  MaxRecordSize = 0x10000   //< Records give their size in a 16-bit field
 };
 
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags) {
@@ -47,7 +45,7 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int g
 perf_event::perf_event() {}
 
 // Open a perf_event file and map it (if sampling is enabled)
-perf_event::perf_event(struct perf_event_attr& pe, pid_t pid, int cpu) :
+perf_event::perf_event(struct perf_event_attr& pe, pid_t pid, int cpu, size_t data_pages) :
     _sample_type(pe.sample_type), _read_format(pe.read_format) {
 
   // Set some mandatory fields
@@ -82,13 +80,26 @@ perf_event::perf_event(struct perf_event_attr& pe, pid_t pid, int cpu) :
   }
 
   // If sampling, map the perf event file
-  if(pe.sample_type != 0 && pe.sample_period != 0) {
-    void* ring_buffer = mmap(NULL, MmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if(pe.sample_type != 0 && pe.sample_period != 0 && data_pages != 0) {
+    REQUIRE((data_pages & (data_pages - 1)) == 0)
+        << "perf_event ring buffer size must be a power of two pages, not " << data_pages;
+    size_t data_size = data_pages * PageSize;
+    void* ring_buffer = mmap(NULL, data_size + PageSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
     REQUIRE(ring_buffer != MAP_FAILED) << "Mapping perf_event ring buffer failed. "
         << "Make sure the current user has permission to invoke the perf tool, and that "
-        << "the program being profiled does not use an excessive number of threads (>1000).\n";
+        << "the program being profiled does not use an excessive number of threads (>1000). "
+        << "Each thread maps " << data_pages << " ring buffer pages; a smaller --ring-pages "
+        << "setting may help.\n";
 
     _mapping = reinterpret_cast<struct perf_event_mmap_page*>(ring_buffer);
+    _data_size = data_size;
+
+    // Deep callchains can make a record much larger than a page. Its pages are only
+    // touched when a record wraps around the end of the ring buffer.
+    void* wrap_buffer = mmap(NULL, MaxRecordSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(wrap_buffer != MAP_FAILED) << "Mapping perf_event record buffer failed";
+    _wrap_buffer = reinterpret_cast<uint8_t*>(wrap_buffer);
   }
 }
 
@@ -101,7 +112,9 @@ perf_event::perf_event(perf_event&& other) {
   }
 
   if(_mapping != nullptr && _mapping != other._mapping)
-    munmap(_mapping, MmapSize);
+    munmap(_mapping, _data_size + PageSize);
+  if(_wrap_buffer != nullptr && _wrap_buffer != other._wrap_buffer)
+    munmap(_wrap_buffer, MaxRecordSize);
 
   // take other perf event's file descriptor and replace it with -1
   _fd = other._fd;
@@ -110,6 +123,10 @@ perf_event::perf_event(perf_event&& other) {
   // take other perf_event's mapping and replace it with nullptr
   _mapping = other._mapping;
   other._mapping = nullptr;
+  _data_size = other._data_size;
+  other._data_size = 0;
+  _wrap_buffer = other._wrap_buffer;
+  other._wrap_buffer = nullptr;
 
   // Copy over the sample type and read format
   _sample_type = other._sample_type;
@@ -127,7 +144,9 @@ void perf_event::operator=(perf_event&& other) {
   if(_fd != -1 && _fd != other._fd)
     ::close(_fd);
   if(_mapping != nullptr && _mapping != other._mapping)
-    munmap(_mapping, MmapSize);
+    munmap(_mapping, _data_size + PageSize);
+  if(_wrap_buffer != nullptr && _wrap_buffer != other._wrap_buffer)
+    munmap(_wrap_buffer, MaxRecordSize);
 
   // take other perf event's file descriptor and replace it with -1
   _fd = other._fd;
@@ -136,6 +155,10 @@ void perf_event::operator=(perf_event&& other) {
   // take other perf_event's mapping and replace it with nullptr
   _mapping = other._mapping;
   other._mapping = nullptr;
+  _data_size = other._data_size;
+  other._data_size = 0;
+  _wrap_buffer = other._wrap_buffer;
+  other._wrap_buffer = nullptr;
 
   // Copy over the sample type and read format
   _sample_type = other._sample_type;
@@ -173,8 +196,14 @@ void perf_event::close() {
   }
 
   if(_mapping != nullptr) {
-    munmap(_mapping, MmapSize);
+    munmap(_mapping, _data_size + PageSize);
     _mapping = nullptr;
+    _data_size = 0;
+  }
+
+  if(_wrap_buffer != nullptr) {
+    munmap(_wrap_buffer, MaxRecordSize);
+    _wrap_buffer = nullptr;
   }
 }
 
@@ -192,27 +221,37 @@ void perf_event::set_ready_signal(int sig) {
       << "failed to set the owner of the perf_event file";
 }
 
-void perf_event::iterator::next() {
-  struct perf_event_header hdr;
+void perf_event::set_output(const perf_event& target) {
+  REQUIRE(ioctl(_fd, PERF_EVENT_IOC_SET_OUTPUT, target._fd) != -1)
+      << "Failed to redirect perf event output: " << strerror(errno);
+}
 
-  // Copy out the record header
-  perf_event::copy_from_ring_buffer(_mapping, _index, &hdr, sizeof(struct perf_event_header));
+struct perf_event_header* perf_event::iterator::peek() const {
+  // Records are 8-byte aligned and the data area is a power of two pages, so a
+  // record header never wraps around the end of the ring buffer
+  uintptr_t base = reinterpret_cast<uintptr_t>(_mapping) + PageSize;
+  size_t offset = _index & (_source._data_size - 1);
+  return reinterpret_cast<struct perf_event_header*>(base + offset);
+}
 
+void perf_event::iterator::next() {
   // Advance to the next record
-  _index += hdr.size;
+  _index += peek()->size;
 }
 
 perf_event::record perf_event::iterator::get() {
-  // Copy out the record header
-  perf_event::copy_from_ring_buffer(_mapping, _index, _buf, sizeof(struct perf_event_header));
+  struct perf_event_header* header = peek();
 
-  // Get a pointer to the header
-  struct perf_event_header* header = reinterpret_cast<struct perf_event_header*>(_buf);
+  // Decode the record in place unless it wraps around the end of the ring buffer
+  size_t offset = _index & (_source._data_size - 1);
+  if(offset + header->size <= _source._data_size) {
+    return perf_event::record(_source, header);
+  }
 
   // Copy out the entire record
-  perf_event::copy_from_ring_buffer(_mapping, _index, _buf, header->size);
-
-  return perf_event::record(_source, header);
+  uint8_t* buf = _source._wrap_buffer;
+  perf_event::copy_from_ring_buffer(_mapping, _source._data_size, _index, buf, header->size);
+  return perf_event::record(_source, reinterpret_cast<struct perf_event_header*>(buf));
 }
 
 bool perf_event::iterator::has_data() const {
@@ -226,27 +265,24 @@ bool perf_event::iterator::has_data() const {
     return false;
   }
 
-  struct perf_event_header hdr;
-  perf_event::copy_from_ring_buffer(_mapping, _index, &hdr, sizeof(struct perf_event_header));
-
   // If the first record is larger than the available data, nothing can be read
-  if(_index + hdr.size > _head) {
+  if(_index + peek()->size > _head) {
     return false;
   }
 
   return true;
 }
 
-void perf_event::copy_from_ring_buffer(struct perf_event_mmap_page* mapping,
+void perf_event::copy_from_ring_buffer(struct perf_event_mmap_page* mapping, size_t data_size,
                                        ptrdiff_t index, void* dest, size_t bytes) {
   uintptr_t base = reinterpret_cast<uintptr_t>(mapping) + PageSize;
-  size_t start_index = index % DataSize;
+  size_t start_index = index & (data_size - 1);
   size_t end_index = start_index + bytes;
 
-  if(end_index <= DataSize) {
+  if(end_index <= data_size) {
     memcpy(dest, reinterpret_cast<void*>(base + start_index), bytes);
   } else {
-    size_t chunk2_size = end_index - DataSize;
+    size_t chunk2_size = end_index - data_size;
     size_t chunk1_size = bytes - chunk2_size;
 
     void* chunk2_dest = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(dest) + chunk1_size);
@@ -297,6 +333,18 @@ wrapped_array<uint64_t> perf_event::record::get_callchain() const {
   return wrapped_array<uint64_t>(base, size);
 }
 
+uint64_t perf_event::record::get_lost() const {
+  ASSERT(is_lost()) << "Record does not have a lost count";
+  // struct { header; u64 id; u64 lost; }
+  return reinterpret_cast<const uint64_t*>(_header + 1)[1];
+}
+
+uint64_t perf_event::record::get_throttle_time() const {
+  ASSERT(is_throttle() || is_unthrottle()) << "Record does not have a throttle time";
+  // struct { header; u64 time; u64 id; u64 stream_id; }
+  return reinterpret_cast<const uint64_t*>(_header + 1)[0];
+}
+
 template<perf_event::sample s, typename T>
 T perf_event::record::locate_field() const {
   uintptr_t p = reinterpret_cast<uintptr_t>(_header) + sizeof(struct perf_event_header);
@@ -42,11 +42,18 @@ public:
   enum class record_type;
   class record;
   class sample_record;
+
+  enum {
+    DefaultDataPages = 2  //< Default size of the ring buffer's data area, in pages
+  };
   
   /// Default constructor
   perf_event();
-  /// Open a perf_event file using the given options structure
-  perf_event(struct perf_event_attr& pe, pid_t pid = 0, int cpu = -1);
+  /// Open a perf_event file using the given options structure. If sampling, map a ring
+  /// buffer with data_pages pages of data, which must be a power of two. If data_pages
+  /// is zero, no buffer is mapped and samples must be redirected with set_output().
+  perf_event(struct perf_event_attr& pe, pid_t pid = 0, int cpu = -1,
+             size_t data_pages = DefaultDataPages);
   /// Move constructor
   perf_event(perf_event&& other);
   
@@ -70,6 +77,18 @@ public:
   
   /// Configure the perf_event file to deliver a signal when samples are ready to be processed
   void set_ready_signal(int sig);
+
+  /// Get the perf_event file descriptor, for polling. Returns -1 if the file is closed.
+  inline int get_fd() const { return _fd; }
+
+  /// Check if the ring buffer may hold unread records, without building an iterator
+  inline bool has_records() const {
+    return _mapping != nullptr &&
+           __atomic_load_n(&_mapping->data_head, __ATOMIC_RELAXED) != _mapping->data_tail;
+  }
+
+  /// Write this event's samples to another event's ring buffer. Both must be on the same CPU.
+  void set_output(const perf_event& target);
   
   /// An enum class with all the available sampling data
   enum class sample : uint64_t {
@@ -166,6 +185,11 @@ public:
     uint64_t get_time() const;
     uint32_t get_cpu() const;
     ccutil::wrapped_array<uint64_t> get_callchain() const;
+
+    /// Get the number of samples dropped because the ring buffer was full (lost records)
+    uint64_t get_lost() const;
+    /// Get the time sampling was throttled or unthrottled (throttle and unthrottle records)
+    uint64_t get_throttle_time() const;
     
   private:
     record(const perf_event& source, struct perf_event_header* header) :
@@ -183,8 +207,8 @@ public:
         _source(source), _mapping(mapping) {
       if(mapping != nullptr) {
         _index = mapping->data_tail;
-        _head = mapping->data_head;
-        //__atomic_thread_fence(__ATOMIC_SEQ_CST); // Not required for thread-local perf events
+        // Records up to the head are only visible once the head is read with acquire order
+        _head = __atomic_load_n(&mapping->data_head, __ATOMIC_ACQUIRE);
       } else {
         _index = 0;
         _head = 0;
@@ -193,7 +217,8 @@ public:
     
     ~iterator() {
       if(_mapping != nullptr) {
-        _mapping->data_tail = _index;
+        // The kernel may overwrite records only after they have been read
+        __atomic_store_n(&_mapping->data_tail, _index, __ATOMIC_RELEASE);
       }
     }
     
@@ -206,13 +231,13 @@ public:
     bool operator!=(const iterator& other) { return has_data() != other.has_data(); }
     
   private:
+    /// Get the header of the current record, in the ring buffer
+    struct perf_event_header* peek() const;
+
     perf_event& _source;
     size_t _index;
     size_t _head;
     struct perf_event_mmap_page* _mapping;
-    
-    // Buffer to hold the current record. Just a hack until records play nice with the ring buffer
-    uint8_t _buf[4096];
   };
   
   /// Get an iterator to the beginning of the memory mapped ring buffer
@@ -231,7 +256,7 @@ private:
   void operator=(const perf_event&) = delete;
   
   // Copy data out of the mmap ring buffer
-  static void copy_from_ring_buffer(struct perf_event_mmap_page* mapping,
+  static void copy_from_ring_buffer(struct perf_event_mmap_page* mapping, size_t data_size,
                                     ptrdiff_t index, void* dest, size_t bytes);
   
   /// File descriptor for the perf event
@@ -239,6 +264,13 @@ private:
   
   /// Memory mapped perf event region
   struct perf_event_mmap_page* _mapping = nullptr;
+
+  /// Size of the ring buffer's data area, which follows one metadata page
+  size_t _data_size = 0;
+
+  /// Holds the current record when it wraps around the end of the ring buffer. Large
+  /// enough for any record, since callchains may be up to 65535 frames deep.
+  uint8_t* _wrap_buffer = nullptr;
   
   /// The sample type from this perf_event's configuration
   uint64_t _sample_type = 0;
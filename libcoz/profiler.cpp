@@ -31,6 +31,11 @@
 #include <limits.h>
 #include <poll.h>
 #include <pthread.h>
+#ifndef __APPLE__
+  #include <dirent.h>
+  #include <sys/epoll.h>
+  #include <sys/syscall.h>
+#endif
 
 #include <algorithm>
 #include <atomic>
@@ -38,6 +43,7 @@
 #include <fstream>
 #include <limits>
 #include <random>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -52,6 +58,82 @@
 
 using namespace std;
 
+enum {
+  ReaderMaxEvents = 64,     //< Perf files to handle per wakeup of the sample reader thread
+  ReaderPollTimeout = 100,  //< Longest the sample reader sleeps before checking for shutdown (ms)
+  CpuRingPages = 32,        //< Default ring buffer size for per-CPU samplers, which every thread shares
+  RetiredLimit = 64         //< Retired samplers an exiting thread may leave for the profiler thread
+};
+
+#ifndef __APPLE__
+/// Fill in the perf_event configuration for sampling
+static void init_sampler_config(struct perf_event_attr& pe, size_t max_stack) {
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_SOFTWARE;
+  pe.config = PERF_COUNT_SW_TASK_CLOCK;
+  pe.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
+  pe.sample_period = SamplePeriod;
+  pe.wakeup_events = SampleBatchSize; // This is ignored on linux 3.13 (why?)
+  pe.exclude_idle = 1;
+  pe.exclude_kernel = 1;
+  pe.disabled = 1;
+  // Have the kernel stop unwinding early, so records are smaller and cheaper to write
+  pe.sample_max_stack = max_stack;
+}
+
+/// Get the most callchain frames the kernel will collect for one sample
+static size_t get_perf_max_stack() {
+  size_t limit = 127;   // The kernel's default, if the limit cannot be read
+  ifstream f("/proc/sys/kernel/perf_event_max_stack");
+  f >> limit;
+  // The sysctl may allow more than the attribute's 16-bit field can hold
+  return min<size_t>(limit, numeric_limits<uint16_t>::max());
+}
+
+/// Get the online CPUs from a list like "0-3,6"
+static vector<int> get_online_cpus() {
+  vector<int> cpus;
+  ifstream f("/sys/devices/system/cpu/online");
+  string range;
+  while(getline(f, range, ',')) {
+    int first, last;
+    char dash;
+    stringstream s(range);
+    if(!(s >> first))
+      continue;
+    if(!(s >> dash >> last))
+      last = first;
+    for(int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  if(cpus.empty()) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int cpu = 0; cpu < n; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+/// Get the IDs of this process's threads
+static vector<pid_t> get_tasks() {
+  vector<pid_t> tasks;
+  DIR* dir = opendir("/proc/self/task");
+  if(dir != nullptr) {
+    while(struct dirent* entry = readdir(dir)) {
+      if(entry->d_name[0] != '.')
+        tasks.push_back(atoi(entry->d_name));
+    }
+    closedir(dir);
+  }
+  if(tasks.empty()) {
+    tasks.push_back(gettid());
+  }
+  return tasks;
+}
+#endif
+
 // Diagnostic counters for delay application (macOS debugging)
 #ifdef __APPLE__
 static std::atomic<size_t> g_delays_applied{0};
@@ -84,10 +166,14 @@ static string json_escape(const string& s) {
   return result;
 }
 
+/// Get the name of a line, as file:line
+static string line_name(const line* l) {
+  return l->get_file()->get_name() + ":" + to_string(l->get_line());
+}
+
 /// Get JSON-safe string representation of a line
 static string line_to_json_string(const line* l) {
-  auto f = l->get_file();
-  return json_escape(f->get_name() + ":" + to_string(l->get_line()));
+  return json_escape(line_name(l));
 }
 
 /// Check if a line is from the coz.h instrumentation header
@@ -136,9 +222,36 @@ void profiler::startup(const string& outfile,
   real::sigaction(SIGBUS, &sa, nullptr);
 #endif
 
+  // A forked child starts without thread state, as it would when looking its tid up
+  pthread_atfork(nullptr, nullptr, profiler::clear_thread_state_in_child);
+
   // Save the output file name
   _output_filename = outfile;
 
+#ifndef __APPLE__
+  // Run experiments together with every other process attached to the same segment.
+  // Only the coordinator's output has experiments, so the others write files of their
+  // own, unless they were started by exec and already have one.
+  const char* shared = getenv("COZ_SHARED");
+  if(shared && shared[0] != '\0') {
+    if(_coordinator.attach(shared)) {
+      _global_delay = &_coordinator.get_global_delay();
+      const char* root_pid = getenv("COZ_ROOT_PID");
+      bool own_output = root_pid && atoi(root_pid) != getpid();
+      if(!_coordinator.try_coordinate(getpid()) && !own_output) {
+        _output_filename = get_process_output(outfile, getpid());
+      }
+    } else {
+      WARNING << "Running experiments in this process only";
+    }
+  }
+#endif
+
+  // Threads take global delay shards in turn, so use about one shard per CPU; threads
+  // beyond that share shards with earlier ones
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cpus > 0) _global_delay->set_shards(cpus);
+
   // Check output format (JSON is the default)
   const char* output_format = getenv("COZ_OUTPUT_FORMAT");
   if(output_format && strcmp(output_format, "json") != 0) {
@@ -146,6 +259,54 @@ void profiler::startup(const string& outfile,
     _json_output = false;
   }
 
+#ifndef __APPLE__
+  // Sample every thread with per-CPU samplers that new threads inherit, instead of
+  // opening a sampler in each thread as it starts
+  _inherit_sampling = getenv("COZ_INHERIT_SAMPLING");
+
+  // Size each thread's perf ring buffer. Larger buffers drop fewer samples when a
+  // thread goes a long time without processing them.
+  _ring_pages = perf_event::DefaultDataPages;
+  if(_inherit_sampling)
+    _ring_pages = CpuRingPages;
+  const char* ring_pages = getenv("COZ_RING_PAGES");
+  if(ring_pages) {
+    size_t pages = strtoul(ring_pages, nullptr, 10);
+    if(pages > 0 && (pages & (pages - 1)) == 0) {
+      _ring_pages = pages;
+    } else {
+      WARNING << "Ignoring COZ_RING_PAGES=" << ring_pages << ": not a power of two";
+    }
+  }
+#endif
+
+  // Limit how much of each sample's callchain is collected and searched for the selected line
+  const char* max_stack = getenv("COZ_MAX_STACK");
+  if(max_stack) {
+    _max_stack = strtoul(max_stack, nullptr, 10);
+#ifndef __APPLE__
+    // perf_event_open rejects depths above the system limit, and the depth must fit
+    // in the attribute's 16-bit field
+    size_t limit = get_perf_max_stack();
+    if(_max_stack > limit) {
+      WARNING << "Limiting COZ_MAX_STACK=" << max_stack << " to the system's maximum of "
+              << limit << " frames (kernel.perf_event_max_stack)";
+      _max_stack = limit;
+    }
+#endif
+  }
+  _first_in_scope_only = getenv("COZ_FIRST_IN_SCOPE_ONLY");
+
+#ifndef __APPLE__
+  // Decode samples on a dedicated thread that polls every thread's perf_event file.
+  // Profiled threads are then only interrupted to pay delays during experiments.
+  // Per-CPU samplers are always read this way.
+  if(getenv("COZ_SAMPLE_READER") || _inherit_sampling) {
+    _sample_reader = true;
+    start_sample_reader();
+  }
+#endif
+
   // If a non-empty fixed line was provided, set it
   if(fixed_line) _fixed_line = fixed_line;
 
@@ -156,6 +317,33 @@ void profiler::startup(const string& outfile,
   // Should end-to-end mode be enabled?
   _enable_end_to_end = end_to_end;
 
+  launch_profiler_thread();
+
+#ifndef __APPLE__
+  if(_inherit_sampling) {
+    open_cpu_samplers();
+  }
+#endif
+}
+
+/**
+ * Open the sample reader's epoll file and start the reader thread. Per-CPU samplers
+ * are opened later, once coz's own threads exist, so those threads do not inherit them.
+ */
+void profiler::start_sample_reader() {
+#ifndef __APPLE__
+  _reader_epoll = epoll_create1(EPOLL_CLOEXEC);
+  REQUIRE(_reader_epoll != -1) << "Failed to create sample reader epoll file: " << strerror(errno);
+  int rc = real::pthread_create(&_reader_thread, nullptr, profiler::start_reader_thread, nullptr);
+  REQUIRE(rc == 0) << "Failed to start sample reader thread";
+#endif
+}
+
+/**
+ * Start the profiler thread and wait for it to open the output file, then begin
+ * sampling in the calling thread
+ */
+void profiler::launch_profiler_thread() {
   // Use a spinlock to wait for the profiler thread to finish intialization
   spinlock l;
   l.lock();
@@ -191,6 +379,10 @@ void profiler::startup(const string& outfile,
 void profiler::profiler_thread(spinlock& l) {
   VERBOSE << "Profiler thread running!";
 
+#ifndef __APPLE__
+  _profiler_tid.store(gettid());
+#endif
+
 #ifdef __APPLE__
   // Register the profiler thread so the sampling thread never suspends it
   macos_register_internal_thread(mach_thread_self());
@@ -224,15 +416,25 @@ void profiler::profiler_thread(spinlock& l) {
   // Unblock the main thread
   VERBOSE << "Profiler thread unlocking spinlock...";
   l.unlock();
+
+  // In shared mode, another process may be running experiments already
+  if(_coordinator.is_attached()) {
+    follow_experiments();
+  }
+
   VERBOSE << "Profiler thread waiting for progress points...";
 
   // Wait until there is at least one progress point
+  import_shared_points();
   _throughput_points_lock.lock();
   _latency_points_lock.lock();
   while(_throughput_points.size() == 0 && _latency_points.size() == 0 && _running) {
     _throughput_points_lock.unlock();
     _latency_points_lock.unlock();
     wait(ExperimentCoolOffTime);
+    // Without experiments, this is the only place exited threads' samplers are released
+    release_retired();
+    import_shared_points();
     _throughput_points_lock.lock();
     _latency_points_lock.lock();
   }
@@ -243,16 +445,26 @@ void profiler::profiler_thread(spinlock& l) {
   size_t sample_log_interval = 32;
   size_t sample_log_countdown = sample_log_interval;
 
+  // Only suggest a larger ring buffer once
+  bool warned_lost_samples = false;
+
   // Main experiment loop
   while(_running) {
     // Select a line
     line* selected;
+    string selected_name;
     if(_fixed_line) {   // If this run has a fixed line, use it
       selected = _fixed_line;
+    } else if(_coordinator.is_attached()) {
+      // Choose from the lines any attached process sampled. The line may be in code
+      // this process has not loaded, and then it is only known by name.
+      selected = choose_shared_line(selected_name);
+      if(!_running) break;
     } else {            // Otherwise, wait for the next line to be selected
       selected = _next_line.load();
       while(_running && selected == nullptr) {
         wait(SamplePeriod * SampleBatchSize);
+        release_retired();
 #ifdef __APPLE__
         // On macOS, must process samples here to set _next_line
         process_all_samples();
@@ -267,6 +479,7 @@ void profiler::profiler_thread(spinlock& l) {
 
     // Store the globally-visible selected line
     _selected_line.store(selected);
+    if(selected != nullptr) selected_name = line_name(selected);
 
     // Choose a delay size
     size_t delay_size;
@@ -283,6 +496,9 @@ void profiler::profiler_thread(spinlock& l) {
 
     _delay_size.store(delay_size);
 
+    // Measure the progress points other attached processes visit, too
+    import_shared_points();
+
     // Save throughput point values at the start of the experiment
     vector<unique_ptr<throughput_point::saved>> saved_throughput_points;
     _throughput_points_lock.lock();
@@ -309,10 +525,16 @@ void profiler::profiler_thread(spinlock& l) {
     // Previously this was before setup, causing 0% baseline experiments to have
     // inflated durations when setup was slow.
     size_t start_time = get_time();
-    size_t starting_samples = selected->get_samples();
-    size_t starting_delay_time = _global_delay.load();
-
-    // Tell threads to start the experiment
+    size_t starting_samples = _coordinator.is_attached() ? _coordinator.get_selected_samples()
+                                                         : get_samples(selected);
+    size_t starting_delay_time = _global_delay->refresh();
+    size_t starting_lost = _lost_samples.load(std::memory_order_relaxed);
+    size_t starting_throttled = _throttled_samples.load(std::memory_order_relaxed);
+
+    // Tell threads to start the experiment, and other attached processes to follow
+    if(_coordinator.is_attached()) {
+      _coordinator.begin_experiment(selected_name, delay_size);
+    }
     _experiment_active.store(true);
 
     // Wait until the experiment ends, or until shutdown if in end-to-end mode
@@ -349,7 +571,7 @@ void profiler::profiler_thread(spinlock& l) {
 
     // Compute experiment parameters
     float speedup = (float)delay_size / (float)SamplePeriod;
-    size_t end_global_delay = _global_delay.load();
+    size_t end_global_delay = _global_delay->refresh();
     size_t end_time = get_time();
     size_t experiment_delay = end_global_delay - starting_delay_time;
     size_t elapsed = end_time - start_time;
@@ -363,7 +585,20 @@ void profiler::profiler_thread(spinlock& l) {
 #else
     size_t duration = elapsed - experiment_delay;
 #endif
-    size_t selected_samples = selected->get_samples() - starting_samples;
+    // Counts read while a thread moves them out of its shard can come up short, so clamp at zero
+    size_t ending_samples = _coordinator.is_attached() ? _coordinator.get_selected_samples()
+                                                       : get_samples(selected);
+    size_t selected_samples = ending_samples > starting_samples ? ending_samples - starting_samples : 0;
+
+    // Samples the kernel dropped or skipped could not insert delays, so the true speedup
+    // was smaller than reported. Record them with the experiment so this is not silent.
+    size_t lost_samples = _lost_samples.load(std::memory_order_relaxed) - starting_lost;
+    size_t throttled_samples = _throttled_samples.load(std::memory_order_relaxed) - starting_throttled;
+    if(lost_samples > 0 && !warned_lost_samples) {
+      WARNING << lost_samples << " samples were lost during an experiment. "
+              << "Use a larger --ring-pages setting to reduce sample loss.";
+      warned_lost_samples = true;
+    }
 
     // Keep a running count of the minimum delta over all progress points
     size_t min_delta = std::numeric_limits<size_t>::max();
@@ -385,16 +620,20 @@ void profiler::profiler_thread(spinlock& l) {
     // effects) have unreliable throughput measurements that corrupt the baseline.
     if(min_delta >= ExperimentTargetDelta) {
       if(_json_output) {
-        output << "{\"type\":\"experiment\",\"selected\":\"" << line_to_json_string(selected) << "\","
+        output << "{\"type\":\"experiment\",\"selected\":\"" << json_escape(selected_name) << "\","
                << "\"speedup\":" << speedup << ","
                << "\"duration\":" << duration << ","
-               << "\"selected_samples\":" << selected_samples << "}\n";
+               << "\"selected_samples\":" << selected_samples << ","
+               << "\"lost_samples\":" << lost_samples << ","
+               << "\"throttled_samples\":" << throttled_samples << "}\n";
       } else {
         output << "experiment\t"
-               << "selected=" << selected << "\t"
+               << "selected=" << selected_name << "\t"
                << "speedup=" << speedup << "\t"
                << "duration=" << duration << "\t"
-               << "selected-samples=" << selected_samples << "\n";
+               << "selected-samples=" << selected_samples << "\t"
+               << "lost-samples=" << lost_samples << "\t"
+               << "throttled-samples=" << throttled_samples << "\n";
       }
 
       for(const auto& s : saved_throughput_points) {
@@ -444,11 +683,17 @@ void profiler::profiler_thread(spinlock& l) {
 
     output.flush();
 
+    // Release resources left behind by threads that exited during the experiment
+    release_retired();
+
     // Clear the next line, so threads will select one
     _next_line.store(nullptr);
 
     // End the experiment
     _experiment_active.store(false);
+    if(_coordinator.is_attached()) {
+      _coordinator.end_experiment();
+    }
 
     // Log samples after a while, then double the countdown
     if(--sample_log_countdown == 0) {
@@ -463,6 +708,11 @@ void profiler::profiler_thread(spinlock& l) {
     if(_running) wait(ExperimentCoolOffTime);
   }
 
+  // Let another attached process take over the experiments
+  if(_coordinator.is_attached()) {
+    _coordinator.resign(getpid());
+  }
+
   // Log the sample counts on exit
   log_samples(output, start_time);
 
@@ -470,6 +720,83 @@ void profiler::profiler_thread(spinlock& l) {
   output.close();
 }
 
+/**
+ * Mirror the coordinator's experiments in this process until the profiler shuts down
+ * or this process becomes the coordinator. Samples in the selected line insert delays
+ * here just as they do in the coordinator, and lines sampled here are offered to the
+ * coordinator for coming experiments.
+ */
+void profiler::follow_experiments() {
+  uint64_t following = 0;   // ID of the experiment being mirrored, or 0 if none
+  while(_running && !_coordinator.try_coordinate(getpid())) {
+    uint64_t id;
+    string name;
+    size_t delay_size;
+    if(_coordinator.get_experiment(id, name, delay_size)) {
+      if(id != following) {
+        // The line is null if it is not in this process, which then only pays delays
+        _experiment_active.store(false);
+        _selected_line.store(memory_map::get_instance().find_line(name));
+        _delay_size.store(delay_size);
+        _experiment_active.store(true);
+        following = id;
+      }
+    } else if(following != 0) {
+      _experiment_active.store(false);
+      release_retired();
+      _next_line.store(nullptr);
+      following = 0;
+    } else {
+      line* l = _next_line.exchange(nullptr);
+      if(l != nullptr) {
+        _coordinator.propose_line(line_name(l));
+      }
+      release_retired();
+    }
+    // Publish any raise left unpublished by a process that died
+    _global_delay->refresh();
+    wait(SamplePeriod);
+  }
+
+  // The coordinator that started a mirrored experiment has exited, or so has this process
+  _experiment_active.store(false);
+  _next_line.store(nullptr);
+}
+
+/**
+ * Wait for a line to speed up, offered by this or any other attached process. Returns
+ * the line, or null if it is not in this process, and sets name to the line's name.
+ */
+line* profiler::choose_shared_line(string& name) {
+  while(_running) {
+    line* l = _next_line.exchange(nullptr);
+    if(l != nullptr) {
+      _coordinator.propose_line(line_name(l));
+    }
+    if(_coordinator.take_proposal(name)) {
+      return memory_map::get_instance().find_line(name);
+    }
+    wait(SamplePeriod * SampleBatchSize);
+    release_retired();
+  }
+  return nullptr;
+}
+
+/**
+ * Add the progress points other attached processes have registered, so the coordinator
+ * measures them even if this process never visits them
+ */
+void profiler::import_shared_points() {
+  if(!_coordinator.is_attached()) return;
+  _coordinator.for_each_point([this](coordinator::point_kind kind, const string& name) {
+    if(kind == coordinator::ThroughputPoint) {
+      get_throughput_point(name);
+    } else {
+      get_latency_point(name);
+    }
+  });
+}
+
 void profiler::log_samples(ofstream& output, size_t start_time) {
   // Log total runtime for phase correction
   if(_json_output) {
@@ -479,22 +806,46 @@ void profiler::log_samples(ofstream& output, size_t start_time) {
            << "time=" << (get_time() - start_time) << "\n";
   }
 
+  // Log PC-to-line cache statistics for exited and running threads
+  size_t cache_hits = _line_cache_hits.load();
+  size_t cache_misses = _line_cache_misses.load();
+  _thread_states.for_each([&cache_hits, &cache_misses](pid_t tid, thread_state* state) {
+    cache_hits += state->pc_cache.get_hits();
+    cache_misses += state->pc_cache.get_misses();
+  });
+  if(_json_output) {
+    output << "{\"type\":\"line-cache\",\"hits\":" << cache_hits << ","
+           << "\"misses\":" << cache_misses << "}\n";
+  } else {
+    output << "line-cache\t"
+           << "hits=" << cache_hits << "\t"
+           << "misses=" << cache_misses << "\n";
+  }
+
+  // Gather the sample counts still held in running threads' shards
+  unordered_map<const line*, size_t> sharded_samples;
+  _thread_states.for_each([&sharded_samples](pid_t tid, thread_state* state) {
+    state->samples.for_each([&sharded_samples](const line* l, size_t n) {
+      sharded_samples[l] += n;
+    });
+  });
+
   // Log sample counts for all observed lines
-  for(const auto& file_entry : memory_map::get_instance().files()) {
-    for(const auto& line_entry : file_entry.second->lines()) {
-      shared_ptr<line> l = line_entry.second;
-      if(l->get_samples() > 0) {
-        if(_json_output) {
-          output << "{\"type\":\"samples\",\"location\":\"" << line_to_json_string(l.get()) << "\","
-                 << "\"count\":" << l->get_samples() << "}\n";
-        } else {
-          output << "samples\t"
-                 << "location=" << l << "\t"
-                 << "count=" << l->get_samples() << "\n";
-        }
+  memory_map::get_instance().for_each_line([&](line* l) {
+    size_t count = l->get_samples();
+    auto sharded = sharded_samples.find(l);
+    if(sharded != sharded_samples.end()) count += sharded->second;
+    if(count > 0) {
+      if(_json_output) {
+        output << "{\"type\":\"samples\",\"location\":\"" << line_to_json_string(l) << "\","
+               << "\"count\":" << count << "}\n";
+      } else {
+        output << "samples\t"
+               << "location=" << l << "\t"
+               << "count=" << count << "\n";
       }
     }
-  }
+  });
 }
 
 /**
@@ -517,6 +868,12 @@ void profiler::shutdown() {
     coz_orig_pthread_join(_profiler_thread, nullptr);
 #else
     real::pthread_join(_profiler_thread, nullptr);
+    if(_sample_reader) {
+      real::pthread_join(_reader_thread, nullptr);
+    }
+
+    // Remove the shared segment if this was the last process using it
+    _coordinator.detach();
 #endif
 
     // Clean up main thread state last
@@ -524,25 +881,119 @@ void profiler::shutdown() {
   }
 }
 
+__thread thread_state* profiler::_current_state = nullptr;
+
 thread_state* profiler::add_thread() {
   pid_t tid = gettid();
   thread_state* inserted = _thread_states.insert(tid);
   if (inserted != nullptr) {
+    inserted->delay_shard = _next_delay_shard.fetch_add(1, std::memory_order_relaxed);
+    // The slot may have belonged to a thread that exited inside a blocking call
+    inserted->blocking = block_nesting();
+    inserted->is_blocked.store(false);
     _num_threads_running += 1;
     VERBOSE << "Registered thread tid=" << tid;
   }
+  _current_state = inserted;
   return inserted;
 }
 
-thread_state* profiler::get_thread_state() {
-  return _thread_states.find(gettid());
-}
-
 void profiler::remove_thread() {
+  _current_state = nullptr;
   _thread_states.remove(gettid());
   _num_threads_running -= 1;
 }
 
+void profiler::clear_thread_state_in_child() {
+  // The forking thread's state belongs to the parent, whose tid the child does not share
+  _current_state = nullptr;
+}
+
+void profiler::before_fork() {
+  _throughput_points_lock.lock();
+  _latency_points_lock.lock();
+  _retired_lock.lock();
+  memory_map::get_instance().before_fork();
+}
+
+void profiler::after_fork(bool child) {
+  memory_map::get_instance().after_fork(child);
+  _retired_lock.unlock();
+  _latency_points_lock.unlock();
+  _throughput_points_lock.unlock();
+
+  // A child of a parent that is shutting down is not profiled
+  if(child && _running.load()) {
+    restart_in_child();
+  }
+}
+
+/**
+ * Profile a forked child on its own. Only the forking thread survives a fork, and the
+ * perf_event files, timers, and epoll set the child inherits still belong to the parent,
+ * so the child closes its copies without stopping them and opens its own. Experiments
+ * start over, and the child writes to an output file named for its PID.
+ */
+void profiler::restart_in_child() {
+  // Forget the parent's threads. A thread may have been holding its state's lock.
+  _thread_states.for_each([this](pid_t tid, thread_state* state) {
+    state->sampler.close();
+    state->process_timer = timer();
+    state->samples.clear();
+    state->pc_cache.clear_stats();
+    state->is_blocked.store(false);
+    state->blocking = block_nesting();
+    state->tid = 0;
+    state->sampler_lock.unlock();
+    _thread_states.remove(tid);
+  });
+  _num_threads_running.store(0);
+  _foreign_thread.samples.clear();
+
+  _retired_samplers.clear();
+  for(timer& t : _retired_timers) t = timer();
+  _retired_timers.clear();
+  _cpu_samplers.clear();
+  _cpu_throttle_times.clear();
+
+  // Samples counted so far belong to the parent's profile
+  _line_cache_hits.store(0);
+  _line_cache_misses.store(0);
+  memory_map::get_instance().for_each_line([](line* l) { l->clear_samples(); });
+
+  // Start with no experiment, and with the delay total up to date
+  _experiment_active.store(false);
+  _selected_line.store(nullptr);
+  _next_line.store(nullptr);
+  _delay_size.store(0);
+  if(_coordinator.is_attached()) {
+    // The child joins the parent's experiments
+    _coordinator.attach_child();
+  }
+  _global_delay->refresh();
+
+  _output_filename = get_process_output(_output_filename, getpid());
+  VERBOSE << "Profiling forked child " << getpid() << " into " << _output_filename;
+
+#ifndef __APPLE__
+  if(_sample_reader) {
+    close(_reader_epoll);
+    start_sample_reader();
+  }
+#endif
+
+  launch_profiler_thread();
+
+#ifndef __APPLE__
+  if(_inherit_sampling) {
+    open_cpu_samplers();
+  }
+#endif
+
+  // Owe none of the delays added before the fork
+  _current_state->local_delay.store(_global_delay->load());
+}
+
 /**
  * Entry point for wrapped threads
  */
@@ -571,22 +1022,37 @@ void* profiler::start_thread(void* p) {
 
 void profiler::begin_sampling(thread_state* state) {
 #ifndef __APPLE__
-  // Set the perf_event sampler configuration (Linux)
+  if(_inherit_sampling) {
+    // This thread inherited the process-wide samplers, so only its samples need a home
+    state->sampler_lock.lock();
+    state->throttle_time = 0;
+    state->tid = gettid();
+    state->sampler_lock.unlock();
+    return;
+  }
+
   struct perf_event_attr pe;
-  memset(&pe, 0, sizeof(pe));
-  pe.type = PERF_TYPE_SOFTWARE;
-  pe.config = PERF_COUNT_SW_TASK_CLOCK;
-  pe.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN;
-  pe.sample_period = SamplePeriod;
-  pe.wakeup_events = SampleBatchSize; // This is ignored on linux 3.13 (why?)
-  pe.exclude_idle = 1;
-  pe.exclude_kernel = 1;
-  pe.disabled = 1;
+  init_sampler_config(pe, _max_stack);
 
   // Create this thread's perf_event sampler and start sampling
-  state->sampler = perf_event(pe);
-  state->process_timer = timer(SampleSignal);
-  state->process_timer.start_interval(SamplePeriod * SampleBatchSize);
+  state->sampler_lock.lock();
+  state->sampler = perf_event(pe, 0, -1, _ring_pages);
+  state->throttle_time = 0;
+  state->tid = gettid();
+  state->sampler_lock.unlock();
+
+  if(_sample_reader) {
+    // Let the reader thread know when a batch of samples is ready
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = state;
+    REQUIRE(epoll_ctl(_reader_epoll, EPOLL_CTL_ADD, state->sampler.get_fd(), &ev) == 0)
+        << "Failed to add perf_event file to the sample reader: " << strerror(errno);
+  } else {
+    state->process_timer = timer(SampleSignal);
+    state->process_timer.start_interval(SamplePeriod * SampleBatchSize);
+  }
   state->sampler.start();
 #else
   // macOS version using timer-based sampling
@@ -597,21 +1063,124 @@ void profiler::begin_sampling(thread_state* state) {
 #endif
 }
 
+/**
+ * Open a sampler on every online CPU for each of this process's threads, with inherit
+ * set so threads created later are sampled by the same events. This includes threads
+ * created without pthread_create. Samples from every thread on a CPU go to one ring
+ * buffer, and are matched to threads by their TID.
+ */
+void profiler::open_cpu_samplers() {
+#ifndef __APPLE__
+  struct perf_event_attr pe;
+  init_sampler_config(pe, _max_stack);
+  pe.sample_type |= PERF_SAMPLE_TID;
+  pe.inherit = 1;
+
+  // coz's own threads are left out. Any that had not recorded its TID yet is sampled,
+  // but its samples are dropped as they are read.
+  vector<pid_t> tasks = get_tasks();
+  tasks.erase(remove_if(tasks.begin(), tasks.end(),
+                        [this](pid_t task) { return is_internal_thread(task); }),
+              tasks.end());
+  vector<int> cpus = get_online_cpus();
+  for(int cpu : cpus) {
+    perf_event* buffer = nullptr;
+    for(pid_t task : tasks) {
+      // The first sampler on each CPU owns the ring buffer, and the rest write to it
+      unique_ptr<perf_event> sampler(new perf_event(pe, task, cpu, buffer ? 0 : _ring_pages));
+      if(buffer != nullptr) {
+        sampler->set_output(*buffer);
+      } else {
+        buffer = sampler.get();
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = buffer;
+        REQUIRE(epoll_ctl(_reader_epoll, EPOLL_CTL_ADD, buffer->get_fd(), &ev) == 0)
+            << "Failed to add perf_event file to the sample reader: " << strerror(errno);
+      }
+      // Start now, so threads created from here on inherit an enabled sampler
+      sampler->start();
+      _cpu_samplers.push_back(move(sampler));
+    }
+  }
+
+  VERBOSE << "Sampling " << tasks.size() << " threads and their children on "
+          << cpus.size() << " CPUs";
+#endif
+}
+
 void profiler::end_sampling() {
   thread_state* state = get_thread_state();
   if(state) {
     state->set_in_use(true);
 
+#ifndef __APPLE__
+    if(_sample_reader && state->sampler.get_fd() != -1) {
+      epoll_ctl(_reader_epoll, EPOLL_CTL_DEL, state->sampler.get_fd(), nullptr);
+    }
+#endif
+
     process_samples(state);
 
+    // The reader thread may still hold an event for this sampler, so close it under the lock
+    state->sampler_lock.lock();
+
     state->sampler.stop();
+#ifndef __APPLE__
+    retire_sampler(state);
+#else
     state->sampler.close();
+#endif
+
+    // Move this thread's sample counts to the shared per-line counters
+    state->samples.flush();
+
+    // Fold this thread's cache statistics into the totals before the slot is reused
+    _line_cache_hits += state->pc_cache.get_hits();
+    _line_cache_misses += state->pc_cache.get_misses();
+    state->pc_cache.clear_stats();
+
+    state->tid = 0;
+    state->sampler_lock.unlock();
 
     remove_thread();
   }
 }
 
-std::pair<line*,bool> profiler::match_line(perf_event::record& sample) {
+/**
+ * Take a stopped sampler and its timer from an exiting thread. Closing the perf_event
+ * file, unmapping its ring buffer and deleting the timer are left to the profiler
+ * thread, which releases them in batches between experiments. If too many pile up,
+ * the exiting thread releases the batch itself so file descriptors stay bounded.
+ */
+void profiler::retire_sampler(thread_state* state) {
+  _retired_lock.lock();
+  _retired_samplers.push_back(move(state->sampler));
+  _retired_timers.push_back(move(state->process_timer));
+  bool full = _retired_samplers.size() >= RetiredLimit;
+  _retired_lock.unlock();
+
+  if(full)
+    release_retired();
+}
+
+/**
+ * Close retired samplers and delete retired timers. Each thread read its samples before
+ * retiring its sampler, so they may be released at any time; the profiler thread does so
+ * between experiments and while it waits for progress points or a line to speed up.
+ */
+void profiler::release_retired() {
+  vector<perf_event> samplers;
+  vector<timer> timers;
+  _retired_lock.lock();
+  samplers.swap(_retired_samplers);
+  timers.swap(_retired_timers);
+  _retired_lock.unlock();
+  // The samplers and timers are closed as the vectors go out of scope
+}
+
+std::pair<line*,bool> profiler::match_line(thread_state* state, perf_event::record& sample) {
   // bool -> true: hit selected_line
   std::pair<line*, bool> match_res(nullptr, false);
   // flag use to increase the sample only for the first line in the source scope. could it be last line in callchain?
@@ -619,19 +1188,27 @@ std::pair<line*,bool> profiler::match_line(perf_event::record& sample) {
   if(!sample.is_sample())
     return match_res;
   // Check if the sample occurred in known code
-  line* l = memory_map::get_instance().find_line(sample.get_ip()).get();
+  line* l = find_line(state, sample.get_ip());
   if(l){
     match_res.first = l;
     first_hit = true;
     if(_selected_line == l){
       match_res.second = true;
+      if(_experiment_active) _coordinator.count_selected_sample();
       return match_res;
     }
   }
-  // Walk the callchain
-  for(uint64_t pc : sample.get_callchain()) {
+  // Walk the callchain, up to the configured depth
+  ccutil::wrapped_array<uint64_t> callchain = sample.get_callchain();
+  size_t depth = callchain.size();
+  if(_max_stack != 0 && depth > _max_stack)
+    depth = _max_stack;
+  for(size_t i = 0; i < depth; i++) {
+    // Only the first in-scope frame counts, and it has already been found
+    if(first_hit && _first_in_scope_only)
+      break;
     // Need to subtract one. PC is the return address, but we're looking for the callsite.
-    l = memory_map::get_instance().find_line(pc-1).get();
+    l = find_line(state, callchain[i]-1);
     if(l){
       if(!first_hit){
         first_hit = true;
@@ -640,6 +1217,7 @@ std::pair<line*,bool> profiler::match_line(perf_event::record& sample) {
       if(_selected_line == l){
         match_res.first = l;
 	match_res.second = true;
+        if(_experiment_active) _coordinator.count_selected_sample();
         return match_res;
       }
     }
@@ -658,7 +1236,7 @@ void profiler::add_delays(thread_state* state) {
     if(state->is_blocked.load()) return;
 
     // Take a snapshot of the global and local delays
-    size_t global_delay = _global_delay.load();
+    size_t global_delay = _global_delay->load();
     size_t local = state->local_delay.load();
 
 #ifdef __APPLE__
@@ -675,7 +1253,7 @@ void profiler::add_delays(thread_state* state) {
       g_delays_skipped.fetch_add(1, std::memory_order_relaxed);
 #else
       // Thread is ahead: increase the global delay time to make other threads pause
-      _global_delay.fetch_add(local - global_delay);
+      _global_delay->raise_to(state->delay_shard, local);
 #endif
 
     } else if(local < global_delay) {
@@ -703,32 +1281,189 @@ void profiler::add_delays(thread_state* state) {
 
   } else {
     // Just skip ahead on delays if there isn't an experiment running
-    state->local_delay.store(_global_delay.load());
+    state->local_delay.store(_global_delay->load());
   }
 }
 
 void profiler::process_samples(thread_state* state) {
+  if(_sample_reader) {
+    // The reader thread may be reading this thread's samples at the same time
+    state->sampler_lock.lock();
+    read_samples(state);
+    state->sampler_lock.unlock();
+  } else {
+    read_samples(state);
+  }
+
+  add_delays(state);
+}
+
+void profiler::add_sample(thread_state* state, perf_event::record& r) {
+  // Find and match the line that contains this sample
+  std::pair<line*, bool> sampled_line = match_line(state, r);
+  if(sampled_line.first) {
+    state->samples.add(sampled_line.first);
+  }
+
+  if(_experiment_active) {
+    // Add a delay if the sample is in the selected line
+    if(sampled_line.second)
+      state->local_delay.fetch_add(_delay_size.load());
+
+  } else if(sampled_line.first != nullptr && _next_line.load() == nullptr
+            && !is_coz_header(sampled_line.first)) {
+    _next_line.store(sampled_line.first);
+  }
+}
+
+void profiler::read_samples(thread_state* state) {
   for(perf_event::record r : state->sampler) {
     if(r.is_sample()) {
-      // Find and match the line that contains this sample
-      std::pair<line*, bool> sampled_line = match_line(r);
-      if(sampled_line.first) {
-        sampled_line.first->add_sample();
-      }
+      add_sample(state, r);
+#ifndef __APPLE__
+    } else if(r.is_lost()) {
+      _lost_samples.fetch_add(r.get_lost(), std::memory_order_relaxed);
 
-      if(_experiment_active) {
-        // Add a delay if the sample is in the selected line
-        if(sampled_line.second)
-          state->local_delay.fetch_add(_delay_size.load());
+    } else if(r.is_throttle()) {
+      state->throttle_time = r.get_throttle_time();
 
-      } else if(sampled_line.first != nullptr && _next_line.load() == nullptr
-                && !is_coz_header(sampled_line.first)) {
-        _next_line.store(sampled_line.first);
+    } else if(r.is_unthrottle() && state->throttle_time != 0) {
+      // Estimate the samples that would have been taken while sampling was throttled
+      uint64_t throttled_for = r.get_throttle_time() - state->throttle_time;
+      _throttled_samples.fetch_add(throttled_for / SamplePeriod, std::memory_order_relaxed);
+      state->throttle_time = 0;
+#endif
+    }
+  }
+}
+
+bool profiler::is_internal_thread(pid_t tid) const {
+  return tid == _profiler_tid.load(std::memory_order_relaxed) ||
+         tid == _reader_tid.load(std::memory_order_relaxed) ||
+         tid == memory_map::get_instance().get_loader_tid();
+}
+
+void profiler::read_cpu_samples(perf_event& sampler, std::vector<thread_state*>& sampled) {
+  for(perf_event::record r : sampler) {
+    if(r.is_sample()) {
+      pid_t tid = static_cast<pid_t>(r.get_tid());
+      thread_state* state = _thread_states.find(tid);
+      if(state != nullptr) {
+        state->sampler_lock.lock();
+        add_sample(state, r);
+        state->sampler_lock.unlock();
+        if(sampled.empty() || sampled.back() != state)
+          sampled.push_back(state);
+
+      } else if(!is_internal_thread(tid)) {
+        // A thread coz did not start, such as one made with a raw clone(). Count its
+        // samples. It has no delay counter, so a selected line sample delays every other
+        // thread, but the thread itself never pauses.
+        std::pair<line*, bool> sampled_line = match_line(&_foreign_thread, r);
+        if(sampled_line.first) {
+          sampled_line.first->add_samples(1);
+        }
+        if(_experiment_active) {
+          if(sampled_line.second)
+            _global_delay->add(_delay_size.load());
+        } else if(sampled_line.first != nullptr && _next_line.load() == nullptr
+                  && !is_coz_header(sampled_line.first)) {
+          _next_line.store(sampled_line.first);
+        }
       }
+#ifndef __APPLE__
+    } else if(r.is_lost()) {
+      _lost_samples.fetch_add(r.get_lost(), std::memory_order_relaxed);
+
+    } else if(r.is_throttle()) {
+      // The samplers sharing a buffer are throttled together when the CPU is over the
+      // kernel's sample rate limit, so one throttle time is kept for the buffer
+      _cpu_throttle_times[&sampler] = r.get_throttle_time();
+
+    } else if(r.is_unthrottle()) {
+      uint64_t& throttle_time = _cpu_throttle_times[&sampler];
+      if(throttle_time != 0) {
+        uint64_t throttled_for = r.get_throttle_time() - throttle_time;
+        _throttled_samples.fetch_add(throttled_for / SamplePeriod, std::memory_order_relaxed);
+        throttle_time = 0;
+      }
+#endif
     }
   }
+}
 
-  add_delays(state);
+void profiler::request_delays(thread_state* state) {
+#ifndef __APPLE__
+  // The state may belong to a thread that has exited since it was sampled. Its
+  // slot is never freed, and end_sampling() clears the tid under sampler_lock.
+  state->sampler_lock.lock();
+  pid_t tid = state->tid;
+  state->sampler_lock.unlock();
+
+  // Blocked threads settle their delays in post_block()
+  if(tid == 0 || state->is_blocked.load())
+    return;
+
+  size_t global_delay = _global_delay->load();
+  size_t local = state->local_delay.load();
+  if(!_experiment_active.load()) {
+    // Skip ahead on delays if there isn't an experiment running
+    state->local_delay.store(global_delay);
+
+  } else if(local > global_delay) {
+    // Thread is ahead: raise the global delay. If the thread raises it from add_delays()
+    // in the few loads between this sum and the addition, the gap is added twice.
+    _global_delay->raise_to(state->delay_shard, local);
+
+  } else if(local < global_delay) {
+    // Thread is behind: interrupt it so it pauses in add_delays()
+    syscall(SYS_tgkill, getpid(), tid, SampleSignal);
+  }
+#endif
+}
+
+/**
+ * Body of the sample reader thread. Each perf_event file becomes readable once a batch
+ * of samples is ready. The reader decodes the batch and credits delays for the selected
+ * line, then signals any sampled thread that owes delays so it pauses in add_delays().
+ * Threads that are not behind are never interrupted.
+ */
+void profiler::reader_thread() {
+#ifndef __APPLE__
+  _reader_tid.store(gettid());
+
+  struct epoll_event events[ReaderMaxEvents];
+  std::vector<thread_state*> sampled;
+  while(_running) {
+    int n = epoll_wait(_reader_epoll, events, ReaderMaxEvents, ReaderPollTimeout);
+    if(n == -1) {
+      REQUIRE(errno == EINTR) << "Sample reader failed to poll: " << strerror(errno);
+      continue;
+    }
+
+    sampled.clear();
+    for(int i = 0; i < n; i++) {
+      if(_inherit_sampling) {
+        // One buffer per CPU, holding samples from every thread that ran there
+        read_cpu_samples(*reinterpret_cast<perf_event*>(events[i].data.ptr), sampled);
+      } else {
+        // The state may belong to a thread that has exited since the event was queued.
+        // Its sampler is closed or replaced under sampler_lock.
+        thread_state* state = reinterpret_cast<thread_state*>(events[i].data.ptr);
+        state->sampler_lock.lock();
+        read_samples(state);
+        state->sampler_lock.unlock();
+        sampled.push_back(state);
+      }
+    }
+
+    sort(sampled.begin(), sampled.end());
+    sampled.erase(unique(sampled.begin(), sampled.end()), sampled.end());
+    for(thread_state* state : sampled) {
+      request_delays(state);
+    }
+  }
+#endif
 }
 
 /**
@@ -755,9 +1490,9 @@ void profiler::process_all_samples() {
     for(perf_event::record r : state->sampler) {
       if(r.is_sample()) {
         samples_processed++;
-        std::pair<line*, bool> sampled_line = match_line(r);
+        std::pair<line*, bool> sampled_line = match_line(state, r);
         if(sampled_line.first) {
-          sampled_line.first->add_sample();
+          state->samples.add(sampled_line.first);
         }
 
         if(experiment_active && sampled_line.second) {
@@ -770,9 +1505,10 @@ void profiler::process_all_samples() {
           thread_state* sampled_state = _thread_states.find(static_cast<pid_t>(sample_tid));
           if(sampled_state) {
             // Push global_delay by exactly delay_size so other threads will catch up.
-            // Using fetch_add (not CAS-to-new_local) prevents stale local_delay
+            // Adding (not raising to new_local) prevents stale local_delay
             // residue from prior experiments inflating _global_delay.
-            size_t new_global = _global_delay.fetch_add(delay_size) + delay_size;
+            _global_delay->add(delay_size);
+            size_t new_global = _global_delay->load_exact();
 
             // Ensure the sampled thread's local_delay is at least new_global so it
             // won't be incorrectly delayed in add_delays() — this thread is being
@@ -837,6 +1573,11 @@ void profiler::apply_pending_delays() {
 /**
  * Entry point for the profiler thread
  */
+void* profiler::start_reader_thread(void*) {
+  profiler::get_instance().reader_thread();
+  return nullptr;
+}
+
 void* profiler::start_profiler_thread(void* arg) {
   spinlock* l = (spinlock*)arg;
   profiler::get_instance().profiler_thread(*l);
@@ -864,8 +1605,15 @@ void profiler::samples_ready(int signum, siginfo_t* info, void* p) {
   state->set_in_use(false);
 #else
   // On Linux, each thread has its own perf_event with samples.
-  // Process this thread's samples and apply delays.
-  profiler::get_instance().process_samples(state);
+  // Process this thread's samples and apply delays. With a reader thread, the samples
+  // have already been processed and this thread was signaled only to pay its delays.
+  if(get_instance()._sample_reader) {
+    state->set_in_use(true);
+    get_instance().add_delays(state);
+    state->set_in_use(false);
+  } else {
+    profiler::get_instance().process_samples(state);
+  }
 #endif
 }
 
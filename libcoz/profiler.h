@@ -11,23 +11,33 @@
 #include <atomic>
 #include <cstdint>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "coz.h"
 
+#include "coordinator.h"
+#include "delay_counter.h"
 #include "inspect.h"
 #include "progress_point.h"
 #include "thread_state.h"
 #include "util.h"
 
 #include "ccutil/spinlock.h"
-#include "ccutil/static_map.h"
+#include "ccutil/thread_registry.h"
 
 /// Type of a thread entry function
 typedef void* (*thread_fn_t)(void*);
 
+/// Place a thread-local variable in the static TLS block, so it is read without a call
+#ifdef __APPLE__
+#define COZ_INITIAL_EXEC_TLS
+#else
+#define COZ_INITIAL_EXEC_TLS __attribute__((tls_model("initial-exec")))
+#endif
+
 #ifdef __APPLE__
 // Original pthread_create that bypasses DYLD_INTERPOSE (defined in mac_interpose.cpp)
 extern "C" int coz_orig_pthread_create(pthread_t*, const pthread_attr_t*,
@@ -72,6 +82,13 @@ public:
   /// Shut down the profiler
   void shutdown();
 
+  /// Take the locks a forked child needs, so no other thread holds them across fork
+  void before_fork();
+
+  /// Release the locks taken by before_fork(). In a child, restart sampling and experiments
+  /// for the thread that survived the fork, with output to a file named for the child's PID.
+  void after_fork(bool child);
+
   /// Get or create a progress point to measure throughput
   throughput_point* get_throughput_point(const std::string& name) {
     // Lock the map of throughput points
@@ -82,7 +99,8 @@ public:
   
     // If there is no match, add a new throughput point
     if(search == _throughput_points.end()) {
-      search = _throughput_points.emplace_hint(search, name, new throughput_point(name));
+      coz_counter_t* shared = get_shared_counters(coordinator::ThroughputPoint, name);
+      search = _throughput_points.emplace_hint(search, name, new throughput_point(name, shared));
     }
   
     // Get the matching or inserted value
@@ -103,7 +121,8 @@ public:
   
     // If there is no match, add a new latency point
     if(search == _latency_points.end()) {
-      search = _latency_points.emplace_hint(search, name, new latency_point(name));
+      coz_counter_t* shared = get_shared_counters(coordinator::LatencyPoint, name);
+      search = _latency_points.emplace_hint(search, name, new latency_point(name, shared));
     }
   
     // Get the matching or inserted value
@@ -133,7 +152,7 @@ public:
     // a stale-high local_delay that would cause them to skip delays.
     size_t parent_delay = state->local_delay.load();
 #ifdef __APPLE__
-    size_t global = _global_delay.load();
+    size_t global = _global_delay->load();
     if(parent_delay > global) parent_delay = global;
 #endif
     new_arg = new thread_start_arg(fn, arg, parent_delay);
@@ -168,6 +187,9 @@ public:
 
     // Handle all samples and add delays as required
     if(_experiment_active) {
+      // Most calls find nothing to read and no delay owed
+      if(is_caught_up(state)) return;
+
       state->set_in_use(true);
 #ifndef __APPLE__
       // On Linux, samples accumulate in the per-thread perf_event buffer between
@@ -183,27 +205,32 @@ public:
     }
   }
 
-  /// Call before (possibly) blocking
+  /// Call before (possibly) blocking. Calls nested inside another blocking call do nothing.
   void pre_block() {
     thread_state* state = get_thread_state();
     if(!state)
       return;
 
     state->is_blocked.store(true);
-    state->pre_block_time = _global_delay.load();
+    state->blocking.enter(_global_delay->load());
   }
 
-  /// Call after unblocking. If by_thread is true, delays will be skipped
+  /// Call after unblocking. If skip_delays is true, delays will be skipped. Only the
+  /// outermost of nested blocking calls settles delays, so they are skipped once.
   void post_block(bool skip_delays) {
     thread_state* state = get_thread_state();
     if(!state)
       return;
 
+    size_t added;
+    if(!state->blocking.leave(_global_delay->load(), added))
+      return;
+
     state->set_in_use(true);
 
     if(skip_delays) {
       // Skip all delays that were inserted during the blocked period
-      state->local_delay.fetch_add(_global_delay.load() - state->pre_block_time);
+      state->local_delay.fetch_add(added);
     }
 
     // Must clear is_blocked before process_samples() because add_delays()
@@ -213,7 +240,7 @@ public:
 #ifndef __APPLE__
     // On Linux, process any samples that accumulated while this thread was
     // blocked to bring its delay counters up to date (BCOZ fix).
-    if(_experiment_active) {
+    if(_experiment_active && !is_caught_up(state)) {
       process_samples(state);
     }
 #endif
@@ -221,17 +248,37 @@ public:
     state->set_in_use(false);
   }
 
+  /// Get the total number of samples in a line, including counts held by running threads
+  size_t get_samples(const line* l) {
+    size_t total = l->get_samples();
+    _thread_states.for_each([l, &total](pid_t tid, thread_state* state) {
+      total += state->samples.get(l);
+    });
+    return total;
+  }
+
   /// Only allow one instance of the profiler, and never run the destructor
   static profiler& get_instance() {
-    static char buf[sizeof(profiler)];
+    alignas(profiler) static char buf[sizeof(profiler)];
     static profiler* p = new(buf) profiler();
     return *p;
   }
 
 private:
+  /// Find the line containing a PC, consulting the thread's PC cache first
+  inline line* find_line(thread_state* state, uintptr_t pc) {
+    memory_map& map = memory_map::get_instance();
+    line* l;
+    state->pc_cache.sync(map.get_generation(), map.get_jit_generation());
+    if(!state->pc_cache.find(pc, l)) {
+      l = map.find_line(pc);
+      state->pc_cache.insert(pc, l);
+    }
+    return l;
+  }
+
   profiler()  {
     _experiment_active.store(false);
-    _global_delay.store(0);
     _delay_size.store(0);
     _selected_line.store(nullptr);
     _next_line.store(nullptr);
@@ -242,21 +289,54 @@ private:
   profiler(const profiler&) = delete;
   void operator=(const profiler&) = delete;
 
+  void launch_profiler_thread();              //< Start the profiler thread and sample the calling thread
+  void follow_experiments();                  //< Mirror the coordinator's experiments (shared mode)
+  line* choose_shared_line(std::string& name);  //< Wait for a line offered by any attached process
+  void import_shared_points();                //< Track progress points registered by other processes
+  void start_sample_reader();                 //< Start the sample reader thread (Linux)
+  void restart_in_child();                    //< Profile a forked child separately from its parent
   void profiler_thread(spinlock& l);          //< Body of the main profiler thread
   void begin_sampling(thread_state* state);   //< Start sampling in the current thread
   void end_sampling();                        //< Stop sampling in the current thread
   void add_delays(thread_state* state);       //< Add any required delays
+
+  /// Check if a thread has no unread samples and is even with the global delay, so
+  /// processing its samples and delays would do nothing
+  inline bool is_caught_up(thread_state* state) {
+#ifndef __APPLE__
+    if(state->sampler.has_records()) return false;
+#endif
+    return state->local_delay.load(std::memory_order_relaxed) == _global_delay->load();
+  }
+
   void process_samples(thread_state* state);  //< Process all available samples and insert delays
+  void read_samples(thread_state* state);     //< Process all available samples without inserting delays
+  void add_sample(thread_state* state, perf_event::record& r);  //< Count one sample and credit its delay
+  void read_cpu_samples(perf_event& sampler, std::vector<thread_state*>& sampled);  //< Process a per-CPU buffer's samples, recording which threads were sampled
+  void request_delays(thread_state* state);   //< Record a sampled thread's delays, or signal it to pay them
+  void open_cpu_samplers();                   //< Open process-wide, per-CPU samplers (Linux)
+  bool is_internal_thread(pid_t tid) const;   //< Check if a thread is one of coz's own (Linux)
+  void retire_sampler(thread_state* state);   //< Take an exiting thread's sampler and timer for later release
+  void release_retired();                     //< Close retired samplers and delete retired timers
+  void reader_thread();                       //< Body of the sample reader thread (Linux)
   void process_all_samples();                 //< Process samples from all threads (for macOS profiler thread)
   void apply_pending_delays();                //< Apply pending delays using Mach thread suspension (macOS)
-  std::pair<line*,bool> match_line(perf_event::record&);       //< Map a sample to its source line and matches with selected_line
+  std::pair<line*,bool> match_line(thread_state* state, perf_event::record&);  //< Map a sample to its source line and matches with selected_line
   void log_samples(std::ofstream&, size_t);   //< Log runtime and sample counts for all identified regions
 
+  /// Get a progress point's counters shared with other processes, or null if not shared
+  coz_counter_t* get_shared_counters(coordinator::point_kind kind, const std::string& name) {
+    return _coordinator.is_attached() ? _coordinator.get_counters(kind, name) : nullptr;
+  }
+
   thread_state* add_thread(); //< Add a thread state entry for this thread
-  thread_state* get_thread_state(); //< Get a reference to the thread state object for this thread
+  /// Get the thread state object for this thread, or null if it is not being sampled
+  inline thread_state* get_thread_state() { return _current_state; }
   void remove_thread(); //< Remove the thread state structure for the current thread
 
+  static void clear_thread_state_in_child();          //< Forget the forking thread's state in a child process
   static void* start_profiler_thread(void*);          //< Entry point for the profiler thread
+  static void* start_reader_thread(void*);            //< Entry point for the sample reader thread
   static void* start_thread(void* arg);               //< Entry point for wrapped threads
   static void samples_ready(int, siginfo_t*, void*);  //< Signal handler for sample processing
   static void on_error(int, siginfo_t*, void*);       //< Handle errors
@@ -269,16 +349,51 @@ private:
   std::unordered_map<std::string, latency_point*> _latency_points;
   spinlock _latency_points_lock;  //< Spinlock that protects the latency points map
 
-  static_map<pid_t, thread_state> _thread_states;   //< Map from thread IDs to thread-local state
+  thread_registry<pid_t, thread_state> _thread_states;  //< Map from thread IDs to thread-local state
+
+  /// This thread's entry in _thread_states, set by add_thread() and cleared by remove_thread().
+  /// Interposed functions and signal handlers read it instead of calling gettid() and searching
+  /// the map. Initial-exec TLS is read without calls, so it is safe in a signal handler.
+  static __thread thread_state* _current_state COZ_INITIAL_EXEC_TLS;
+
   std::atomic<size_t> _num_threads_running;         //< Number of threads that are currently being sampled
 
   std::atomic<bool> _experiment_active; //< Is an experiment running?
-  std::atomic<size_t> _global_delay;    //< The global delay time required
+  coordinator _coordinator;             //< Experiment state shared with other processes, if any
+  delay_counter _own_delay;             //< The global delay, unless shared with other processes
+  delay_counter* _global_delay = &_own_delay;   //< The global delay time required
+  std::atomic<size_t> _next_delay_shard{0};   //< Delay counter shard for the next registered thread
   std::atomic<size_t> _delay_size;      //< The current delay size
   std::atomic<line*> _selected_line;    //< The line to speed up
   std::atomic<line*> _next_line;        //< The next line to speed up
 
+  std::atomic<size_t> _line_cache_hits{0};    //< PC cache hits from threads that have exited
+  std::atomic<size_t> _line_cache_misses{0};  //< PC cache misses from threads that have exited
+
+  std::atomic<size_t> _lost_samples{0};       //< Samples dropped because a ring buffer was full
+  std::atomic<size_t> _throttled_samples{0};  //< Estimated samples skipped while throttled
+  size_t _ring_pages = 0;                     //< Ring buffer data pages per thread (Linux)
+  size_t _max_stack = 0;          //< Callchain frames to collect and search, or 0 for all
+  bool _first_in_scope_only = false;  //< Only match the selected line in a sample's first in-scope frame
+
+  bool _sample_reader = false;    //< Read samples on a dedicated thread instead of in each thread
+  int _reader_epoll = -1;         //< Polls every thread's perf_event file in sample reader mode
+  pthread_t _reader_thread;       //< Handle for the sample reader thread
+  std::atomic<pid_t> _reader_tid{0};    //< The sample reader thread, once it has started
+
+  bool _inherit_sampling = false; //< Sample all threads with inherited per-CPU samplers
+  std::vector<std::unique_ptr<perf_event>> _cpu_samplers;  //< Inherited samplers, for every CPU and
+                                                           //< every thread that existed at startup
+  std::unordered_map<perf_event*, uint64_t> _cpu_throttle_times;  //< When each per-CPU buffer's
+                                                           //< samplers were throttled, or 0
+  thread_state _foreign_thread;   //< Line cache for samples from threads without a state
+
+  spinlock _retired_lock;                   //< Protects the retired samplers and timers
+  std::vector<perf_event> _retired_samplers;  //< Stopped samplers of exited threads, not yet closed
+  std::vector<timer> _retired_timers;         //< Timers of exited threads, not yet deleted
+
   pthread_t _profiler_thread;     //< Handle for the profiler thread
+  std::atomic<pid_t> _profiler_tid{0};  //< The profiler thread, once it has started
   std::atomic<bool> _running;     //< Clear to signal the profiler thread to quit
   std::string _output_filename;   //< File for profiler output
   line* _fixed_line;              //< The only line that should be sped up, if set
@@ -33,8 +33,10 @@ class throughput_point {
 public:
   class saved;
   
-  /// Create a throughput progress point with a given name
-  throughput_point(const std::string& name) : _name(name), _counter() {}
+  /// Create a throughput progress point with a given name. The point counts in its own
+  /// counter, or in a counter shared with other processes if one is given.
+  throughput_point(const std::string& name, coz_counter_t* shared = nullptr) :
+      _name(name), _own_counter(), _counter(shared ? shared : &_own_counter) {}
   
   /// Save the state of this progress point
   saved* save() const {
@@ -43,17 +45,17 @@ public:
 
   /// Add one to the number of visits to this progress point
   void visit(size_t visits=1) {
-    __atomic_add_fetch(&_counter.count, visits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_counter->count, visits, __ATOMIC_RELAXED);
   }
 
   /// Get the number of visits to this progress point
   size_t get_count() const {
-    return __atomic_load_n(&_counter.count, __ATOMIC_RELAXED);
+    return __atomic_load_n(&_counter->count, __ATOMIC_RELAXED);
   }
   
   /// Get a pointer to the counter struct (used by source progress points)
   coz_counter_t* get_counter_struct() {
-    return &_counter;
+    return _counter;
   }
 
   /// Get the name of this progress point
@@ -90,7 +92,8 @@ public:
 
 private:
   const std::string _name;
-  coz_counter_t _counter;
+  coz_counter_t _own_counter;
+  coz_counter_t* _counter;    //< The counter in use: _own_counter, or a shared one
 };
 
 /**
@@ -100,8 +103,12 @@ class latency_point {
 public:
   class saved;
   
-  /// Create a latency progress point with a given name
-  latency_point(const std::string& name) : _name(name), _begin_counter(), _end_counter() {}
+  /// Create a latency progress point with a given name. The point counts in its own
+  /// counters, or in a begin and end counter shared with other processes if given.
+  latency_point(const std::string& name, coz_counter_t* shared = nullptr) :
+      _name(name), _own_counters(),
+      _begin_counter(shared ? &shared[0] : &_own_counters[0]),
+      _end_counter(shared ? &shared[1] : &_own_counters[1]) {}
   
   /// Save the state of this progress point
   saved* save() const {
@@ -110,32 +117,32 @@ public:
 
   /// Add one visit to the begin progress point
   void visit_begin(size_t visits=1) {
-    __atomic_add_fetch(&_begin_counter.count, visits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_begin_counter->count, visits, __ATOMIC_RELAXED);
   }
   
   /// Add one visit to the end progress point
   void visit_end(size_t visits=1) {
-    __atomic_add_fetch(&_end_counter.count, visits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_end_counter->count, visits, __ATOMIC_RELAXED);
   }
 
   /// Get the number of visits to the begin progress point
   size_t get_begin_count() const {
-    return __atomic_load_n(&_begin_counter.count, __ATOMIC_RELAXED);
+    return __atomic_load_n(&_begin_counter->count, __ATOMIC_RELAXED);
   }
   
   /// Get the number of visits to the end progress point
   size_t get_end_count() const {
-    return __atomic_load_n(&_end_counter.count, __ATOMIC_RELAXED);
+    return __atomic_load_n(&_end_counter->count, __ATOMIC_RELAXED);
   }
   
   /// Get a pointer to the begin point's counter struct (used by source progress points)
   coz_counter_t* get_begin_counter_struct() {
-    return &_begin_counter;
+    return _begin_counter;
   }
   
   /// Get a pointer to the end point's counter struct (used by source progress points)
   coz_counter_t* get_end_counter_struct() {
-    return &_end_counter;
+    return _end_counter;
   }
 
   /// Get the name of this progress point
@@ -185,8 +192,9 @@ public:
 
 private:
   const std::string _name;
-  coz_counter_t _begin_counter;
-  coz_counter_t _end_counter;
+  coz_counter_t _own_counters[2];
+  coz_counter_t* _begin_counter;  //< The begin counter in use, own or shared
+  coz_counter_t* _end_counter;    //< The end counter in use, own or shared
 };
 
 #endif
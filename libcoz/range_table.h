@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_RANGE_TABLE_H)
+#define CAUSAL_RUNTIME_RANGE_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A read-only map from non-overlapping address ranges to values, used on the
+ * sampling hot path in place of a std::map. Range base addresses are stored in
+ * Eytzinger (BFS) order so a lookup walks one contiguous array from the root
+ * down, touching a predictable sequence of cache lines that can be prefetched
+ * several levels ahead. The ranges themselves are kept in sorted order.
+ *
+ * Ranges must be added in increasing order of base address, then freeze() must
+ * be called before any lookups.
+ */
+template<typename T>
+class range_table {
+public:
+  /// Discard all ranges
+  void clear() {
+    _entries.clear();
+    _keys.clear();
+    _order.clear();
+  }
+
+  /// Reserve space for a known number of ranges
+  void reserve(size_t n) {
+    _entries.reserve(n);
+  }
+
+  /// Append a range. Ranges must be added in sorted order and must not overlap.
+  void add(uintptr_t base, uintptr_t limit, T* value) {
+    _entries.push_back(entry{base, limit, value});
+  }
+
+  /// Lay out the search keys for lookups. Must be called after the last add().
+  void freeze() {
+    size_t n = _entries.size();
+    _keys.assign(n + 1, 0);
+    _order.assign(n + 1, 0);
+    size_t next = 0;
+    fill(1, next);
+  }
+
+  /// Find the value for the range containing addr, or nullptr if there is none
+  inline T* find(uintptr_t addr) const {
+    size_t n = _entries.size();
+    const uintptr_t* keys = _keys.data();
+
+    // Descend to the first key greater than addr. Each step is branch-free, and
+    // the keys four levels below the current node are contiguous, so fetch them now.
+    size_t k = 1;
+    while(k <= n) {
+      __builtin_prefetch(keys + k * PrefetchStride);
+      k = 2 * k + (keys[k] <= addr);
+    }
+
+    // Undo the trailing right turns to recover the node where the search last went left
+    k >>= __builtin_ffsll(~static_cast<unsigned long long>(k));
+
+    // The candidate range is the one just before the upper bound in sorted order
+    size_t upper = (k == 0) ? n : _order[k];
+    if(upper == 0)
+      return nullptr;
+
+    const entry& e = _entries[upper - 1];
+    if(addr < e.limit)
+      return e.value;
+    return nullptr;
+  }
+
+  /// Get the number of ranges in the table
+  size_t size() const { return _entries.size(); }
+
+  /// Check if the table is empty
+  bool empty() const { return _entries.empty(); }
+
+private:
+  enum {
+    PrefetchStride = 16 //< Prefetch the descendants four levels below the current node
+  };
+
+  struct entry {
+    uintptr_t base;
+    uintptr_t limit;
+    T* value;
+  };
+
+  /// Recursively place sorted keys into Eytzinger order with an in-order walk of the implicit tree
+  void fill(size_t k, size_t& next) {
+    if(k < _keys.size()) {
+      fill(2 * k, next);
+      _keys[k] = _entries[next].base;
+      _order[k] = static_cast<uint32_t>(next);
+      next++;
+      fill(2 * k + 1, next);
+    }
+  }
+
+  std::vector<entry> _entries;    //< Ranges in sorted order
+  std::vector<uintptr_t> _keys;   //< Range base addresses in Eytzinger order (1-indexed)
+  std::vector<uint32_t> _order;   //< Sorted index of the range at each Eytzinger position
+};
+
+#endif
@@ -11,6 +11,7 @@
 #include <dlfcn.h>
 
 #include <dlfcn.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -293,6 +294,249 @@ static int resolve_pthread_rwlock_unlock(pthread_rwlock_t* rwlock) throw() {
   else return 0;  // Silently elide synchronization during linking
 }
 
+#ifndef __APPLE__
+static ssize_t resolve_read(int fd, void* buf, size_t count) throw() {
+  GET_SYMBOL(read);
+  if(real_read) return real_read(fd, buf, count);
+  else return -1;
+}
+
+static ssize_t resolve_recv(int fd, void* buf, size_t len, int flags) throw() {
+  GET_SYMBOL(recv);
+  if(real_recv) return real_recv(fd, buf, len, flags);
+  else return -1;
+}
+
+static ssize_t resolve_recvfrom(int fd, void* buf, size_t len, int flags, struct sockaddr* sa, socklen_t* salen) throw() {
+  GET_SYMBOL(recvfrom);
+  if(real_recvfrom) return real_recvfrom(fd, buf, len, flags, sa, salen);
+  else return -1;
+}
+
+static ssize_t resolve_recvmsg(int fd, struct msghdr* msg, int flags) throw() {
+  GET_SYMBOL(recvmsg);
+  if(real_recvmsg) return real_recvmsg(fd, msg, flags);
+  else return -1;
+}
+
+static int resolve_accept(int fd, struct sockaddr* sa, socklen_t* salen) throw() {
+  GET_SYMBOL(accept);
+  if(real_accept) return real_accept(fd, sa, salen);
+  else return -1;
+}
+
+static int resolve_accept4(int fd, struct sockaddr* sa, socklen_t* salen, int flags) throw() {
+  GET_SYMBOL(accept4);
+  if(real_accept4) return real_accept4(fd, sa, salen, flags);
+  else return -1;
+}
+
+static int resolve_close(int fd) throw() {
+  GET_SYMBOL(close);
+  if(real_close) return real_close(fd);
+  else return -1;
+}
+
+static int resolve_dup2(int oldfd, int newfd) throw() {
+  GET_SYMBOL(dup2);
+  if(real_dup2) return real_dup2(oldfd, newfd);
+  else return -1;
+}
+
+static int resolve_dup3(int oldfd, int newfd, int flags) throw() {
+  GET_SYMBOL(dup3);
+  if(real_dup3) return real_dup3(oldfd, newfd, flags);
+  else return -1;
+}
+
+static int resolve_fclose(FILE* f) throw() {
+  GET_SYMBOL(fclose);
+  if(real_fclose) return real_fclose(f);
+  else return EOF;
+}
+
+static int resolve_pclose(FILE* f) throw() {
+  GET_SYMBOL(pclose);
+  if(real_pclose) return real_pclose(f);
+  else return -1;
+}
+
+/// fcntl() is variadic, but no command takes more than one argument
+static int resolve_fcntl(int fd, int cmd, ...) throw() {
+  va_list args;
+  va_start(args, cmd);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+
+  GET_SYMBOL(fcntl);
+  if(real_fcntl) return real_fcntl(fd, cmd, arg);
+  else return -1;
+}
+
+#ifdef COZ_HAVE_FCNTL64
+static int resolve_fcntl64(int fd, int cmd, ...) throw() {
+  va_list args;
+  va_start(args, cmd);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+
+  GET_SYMBOL(fcntl64);
+  if(real_fcntl64) return real_fcntl64(fd, cmd, arg);
+  else return -1;
+}
+#endif
+
+#ifdef COZ_HAVE_CLOSE_RANGE
+static int resolve_close_range(unsigned int first, unsigned int last, int flags) throw() {
+  GET_SYMBOL(close_range);
+  if(real_close_range) return real_close_range(first, last, flags);
+  else return -1;
+}
+
+static void resolve_closefrom(int lowfd) throw() {
+  GET_SYMBOL(closefrom);
+  if(real_closefrom) real_closefrom(lowfd);
+}
+#endif
+
+/// ioctl() is variadic, but no request takes more than one argument
+static int resolve_ioctl(int fd, unsigned long request, ...) throw() {
+  va_list args;
+  va_start(args, request);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+
+  GET_SYMBOL(ioctl);
+  if(real_ioctl) return real_ioctl(fd, request, arg);
+  else return -1;
+}
+
+static int resolve_poll(struct pollfd* fds, nfds_t nfds, int timeout) throw() {
+  GET_SYMBOL(poll);
+  if(real_poll) return real_poll(fds, nfds, timeout);
+  else return -1;
+}
+
+static int resolve_ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout, const sigset_t* sigmask) throw() {
+  GET_SYMBOL(ppoll);
+  if(real_ppoll) return real_ppoll(fds, nfds, timeout, sigmask);
+  else return -1;
+}
+
+static int resolve_select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) throw() {
+  GET_SYMBOL(select);
+  if(real_select) return real_select(nfds, readfds, writefds, exceptfds, timeout);
+  else return -1;
+}
+
+static int resolve_pselect(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, const struct timespec* timeout, const sigset_t* sigmask) throw() {
+  GET_SYMBOL(pselect);
+  if(real_pselect) return real_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+  else return -1;
+}
+
+static int resolve_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) throw() {
+  GET_SYMBOL(epoll_wait);
+  if(real_epoll_wait) return real_epoll_wait(epfd, events, maxevents, timeout);
+  else return -1;
+}
+
+static int resolve_epoll_pwait(int epfd, struct epoll_event* events, int maxevents, int timeout, const sigset_t* sigmask) throw() {
+  GET_SYMBOL(epoll_pwait);
+  if(real_epoll_pwait) return real_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+  else return -1;
+}
+
+static int resolve_nanosleep(const struct timespec* req, struct timespec* rem) throw() {
+  GET_SYMBOL(nanosleep);
+  if(real_nanosleep) return real_nanosleep(req, rem);
+  else return -1;
+}
+
+static int resolve_clock_nanosleep(clockid_t clock, int flags, const struct timespec* req, struct timespec* rem) throw() {
+  GET_SYMBOL(clock_nanosleep);
+  if(real_clock_nanosleep) return real_clock_nanosleep(clock, flags, req, rem);
+  else return ENOSYS;
+}
+
+static int resolve_usleep(useconds_t usec) throw() {
+  GET_SYMBOL(usleep);
+  if(real_usleep) return real_usleep(usec);
+  else return -1;
+}
+
+static unsigned int resolve_sleep(unsigned int seconds) throw() {
+  GET_SYMBOL(sleep);
+  if(real_sleep) return real_sleep(seconds);
+  else return seconds;
+}
+
+static int resolve_sem_wait(sem_t* sem) throw() {
+  GET_SYMBOL_HANDLE(sem_wait, get_pthread_handle());
+  if(real_sem_wait) return real_sem_wait(sem);
+  else return 0;  // Silently elide synchronization during linking
+}
+
+static int resolve_sem_trywait(sem_t* sem) throw() {
+  GET_SYMBOL_HANDLE(sem_trywait, get_pthread_handle());
+  if(real_sem_trywait) return real_sem_trywait(sem);
+  else return 0;  // Silently elide synchronization during linking
+}
+
+static int resolve_sem_timedwait(sem_t* sem, const struct timespec* abstime) throw() {
+  GET_SYMBOL_HANDLE(sem_timedwait, get_pthread_handle());
+  if(real_sem_timedwait) return real_sem_timedwait(sem, abstime);
+  else return 0;  // Silently elide synchronization during linking
+}
+
+static int resolve_sem_post(sem_t* sem) throw() {
+  GET_SYMBOL_HANDLE(sem_post, get_pthread_handle());
+  if(real_sem_post) return real_sem_post(sem);
+  else return 0;  // Silently elide synchronization during linking
+}
+
+/// syscall() is variadic, so pass on the most arguments any system call takes
+static long resolve_syscall(long number, ...) throw() {
+  va_list args;
+  va_start(args, number);
+  long a1 = va_arg(args, long);
+  long a2 = va_arg(args, long);
+  long a3 = va_arg(args, long);
+  long a4 = va_arg(args, long);
+  long a5 = va_arg(args, long);
+  long a6 = va_arg(args, long);
+  va_end(args);
+
+  GET_SYMBOL(syscall);
+  if(real_syscall) return real_syscall(number, a1, a2, a3, a4, a5, a6);
+  else return -1;
+}
+
+static int resolve_execve(const char* path, char* const argv[], char* const envp[]) throw() {
+  GET_SYMBOL(execve);
+  if(real_execve) return real_execve(path, argv, envp);
+  else return -1;
+}
+
+static int resolve_posix_spawn(pid_t* pid, const char* path,
+                               const posix_spawn_file_actions_t* file_actions,
+                               const posix_spawnattr_t* attrp,
+                               char* const argv[], char* const envp[]) {
+  GET_SYMBOL(posix_spawn);
+  if(real_posix_spawn) return real_posix_spawn(pid, path, file_actions, attrp, argv, envp);
+  else return ENOSYS;
+}
+
+static int resolve_posix_spawnp(pid_t* pid, const char* file,
+                                const posix_spawn_file_actions_t* file_actions,
+                                const posix_spawnattr_t* attrp,
+                                char* const argv[], char* const envp[]) {
+  GET_SYMBOL(posix_spawnp);
+  if(real_posix_spawnp) return real_posix_spawnp(pid, file, file_actions, attrp, argv, envp);
+  else return ENOSYS;
+}
+#endif
+
 #define DEFINE_WRAPPER(name) decltype(::name)* name = &resolve_##name;
 
 /**
@@ -352,4 +596,47 @@ namespace real {
   DEFINE_WRAPPER(pthread_rwlock_timedwrlock);
 #endif
   DEFINE_WRAPPER(pthread_rwlock_unlock);
+
+#ifndef __APPLE__
+  DEFINE_WRAPPER(read);
+  DEFINE_WRAPPER(recv);
+  DEFINE_WRAPPER(recvfrom);
+  DEFINE_WRAPPER(recvmsg);
+  DEFINE_WRAPPER(accept);
+  DEFINE_WRAPPER(accept4);
+  DEFINE_WRAPPER(close);
+  DEFINE_WRAPPER(dup2);
+  DEFINE_WRAPPER(dup3);
+  DEFINE_WRAPPER(fclose);
+  DEFINE_WRAPPER(pclose);
+  DEFINE_WRAPPER(fcntl);
+#ifdef COZ_HAVE_FCNTL64
+  DEFINE_WRAPPER(fcntl64);
+#endif
+#ifdef COZ_HAVE_CLOSE_RANGE
+  DEFINE_WRAPPER(close_range);
+  DEFINE_WRAPPER(closefrom);
+#endif
+  DEFINE_WRAPPER(ioctl);
+  DEFINE_WRAPPER(poll);
+  DEFINE_WRAPPER(ppoll);
+  DEFINE_WRAPPER(select);
+  DEFINE_WRAPPER(pselect);
+  DEFINE_WRAPPER(epoll_wait);
+  DEFINE_WRAPPER(epoll_pwait);
+  DEFINE_WRAPPER(nanosleep);
+  DEFINE_WRAPPER(clock_nanosleep);
+  DEFINE_WRAPPER(usleep);
+  DEFINE_WRAPPER(sleep);
+
+  DEFINE_WRAPPER(sem_wait);
+  DEFINE_WRAPPER(sem_trywait);
+  DEFINE_WRAPPER(sem_timedwait);
+  DEFINE_WRAPPER(sem_post);
+  DEFINE_WRAPPER(syscall);
+
+  DEFINE_WRAPPER(execve);
+  DEFINE_WRAPPER(posix_spawn);
+  DEFINE_WRAPPER(posix_spawnp);
+#endif
 }
@@ -11,8 +11,29 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef __APPLE__
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <semaphore.h>
+  #include <spawn.h>
+  #include <stdio.h>
+  #include <sys/epoll.h>
+  #include <sys/ioctl.h>
+  #include <sys/select.h>
+  #include <sys/socket.h>
+
+  // fcntl64 appeared in glibc 2.28, and close_range and closefrom in 2.34
+  #if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 28)
+    #define COZ_HAVE_FCNTL64 1
+  #endif
+  #if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    #define COZ_HAVE_CLOSE_RANGE 1
+  #endif
+#endif
+
 #define DECLARE_WRAPPER(name) extern decltype(::name)* name;
 
 namespace real {
@@ -68,6 +89,49 @@ namespace real {
   DECLARE_WRAPPER(pthread_rwlock_timedwrlock);
 #endif
   DECLARE_WRAPPER(pthread_rwlock_unlock);
+
+#ifndef __APPLE__
+  DECLARE_WRAPPER(read);
+  DECLARE_WRAPPER(recv);
+  DECLARE_WRAPPER(recvfrom);
+  DECLARE_WRAPPER(recvmsg);
+  DECLARE_WRAPPER(accept);
+  DECLARE_WRAPPER(accept4);
+  DECLARE_WRAPPER(close);
+  DECLARE_WRAPPER(dup2);
+  DECLARE_WRAPPER(dup3);
+  DECLARE_WRAPPER(fclose);
+  DECLARE_WRAPPER(pclose);
+  DECLARE_WRAPPER(fcntl);
+#ifdef COZ_HAVE_FCNTL64
+  DECLARE_WRAPPER(fcntl64);
+#endif
+#ifdef COZ_HAVE_CLOSE_RANGE
+  DECLARE_WRAPPER(close_range);
+  DECLARE_WRAPPER(closefrom);
+#endif
+  DECLARE_WRAPPER(ioctl);
+  DECLARE_WRAPPER(poll);
+  DECLARE_WRAPPER(ppoll);
+  DECLARE_WRAPPER(select);
+  DECLARE_WRAPPER(pselect);
+  DECLARE_WRAPPER(epoll_wait);
+  DECLARE_WRAPPER(epoll_pwait);
+  DECLARE_WRAPPER(nanosleep);
+  DECLARE_WRAPPER(clock_nanosleep);
+  DECLARE_WRAPPER(usleep);
+  DECLARE_WRAPPER(sleep);
+
+  DECLARE_WRAPPER(sem_wait);
+  DECLARE_WRAPPER(sem_trywait);
+  DECLARE_WRAPPER(sem_timedwait);
+  DECLARE_WRAPPER(sem_post);
+  DECLARE_WRAPPER(syscall);
+
+  DECLARE_WRAPPER(execve);
+  DECLARE_WRAPPER(posix_spawn);
+  DECLARE_WRAPPER(posix_spawnp);
+#endif
 };
 
 #endif
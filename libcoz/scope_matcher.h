@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2015, Charlie Curtsinger and Emery Berger,
+ *                     University of Massachusetts Amherst
+ * This file is part of the Coz project. See LICENSE.md file at the top-level
+ * directory of this distribution and at http://github.com/plasma-umass/coz.
+ */
+
+#if !defined(CAUSAL_RUNTIME_SCOPE_MATCHER_H)
+#define CAUSAL_RUNTIME_SCOPE_MATCHER_H
+
+#include <cstddef>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * A set of scope patterns, where '%' matches any run of characters, compiled for
+ * matching without backtracking. Each pattern is split at its wildcards into literal
+ * parts: the first must be a prefix of the subject, the last a suffix, and the
+ * parts in between are found left to right. Taking the leftmost match for every
+ * part is always safe, since it leaves the most room for the parts that follow.
+ *
+ * As with the recursive matcher this replaces, a wildcard never starts at the very
+ * end of the subject, so "abc%" does not match "abc".
+ */
+class scope_matcher {
+public:
+  scope_matcher() {}
+
+  explicit scope_matcher(const std::unordered_set<std::string>& patterns) {
+    for(const std::string& p : patterns) {
+      add(p);
+    }
+  }
+
+  /// Add a pattern to the set
+  void add(const std::string& text) {
+    pattern p;
+    size_t pos = 0;
+    size_t wildcard;
+    while((wildcard = text.find('%', pos)) != std::string::npos) {
+      p.parts.push_back(text.substr(pos, wildcard - pos));
+      pos = wildcard + 1;
+    }
+    p.parts.push_back(text.substr(pos));
+    _patterns.push_back(std::move(p));
+  }
+
+  /// Check if a subject matches any pattern in the set
+  bool matches(const std::string& subject) const {
+    for(const pattern& p : _patterns) {
+      if(matches(p, subject))
+        return true;
+    }
+    return false;
+  }
+
+  /// Check if the set has no patterns
+  bool empty() const { return _patterns.empty(); }
+
+  /// Get the number of patterns in the set
+  size_t size() const { return _patterns.size(); }
+
+private:
+  struct pattern {
+    std::vector<std::string> parts;   //< Literal text between wildcards
+  };
+
+  static bool matches(const pattern& p, const std::string& subject) {
+    const std::vector<std::string>& parts = p.parts;
+    size_t n = subject.size();
+
+    // A pattern without wildcards must match exactly
+    if(parts.size() == 1)
+      return subject == parts[0];
+
+    const std::string& first = parts.front();
+    const std::string& last = parts.back();
+    if(first.size() + last.size() > n)
+      return false;
+    if(subject.compare(0, first.size(), first) != 0)
+      return false;
+    if(subject.compare(n - last.size(), last.size(), last) != 0)
+      return false;
+
+    // Place the middle parts as early as possible, without running into the suffix
+    size_t pos = first.size();
+    size_t end = n - last.size();
+    for(size_t i = 1; i + 1 < parts.size(); i++) {
+      if(pos >= n)
+        return false;   // A wildcard would start at the end of the subject
+      size_t found = subject.find(parts[i], pos);
+      if(found == std::string::npos || found + parts[i].size() > end)
+        return false;
+      pos = found + parts[i].size();
+    }
+
+    // The last wildcard starts where the middle parts left off
+    return pos < n;
+  }
+
+  std::vector<pattern> _patterns;
+};
+
+#endif
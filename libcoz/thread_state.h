@@ -9,17 +9,193 @@
 #define CAUSAL_RUNTIME_THREAD_STATE_H
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 
+#include "block_nesting.h"
+#include "inspect.h"
+
+#include "ccutil/spinlock.h"
 #include "ccutil/timer.h"
 
+/**
+ * A direct-mapped cache from sampled PCs to the lines that contain them. One thread
+ * at a time reads or fills the cache: the owning thread, or, when samples are read
+ * by the sample reader thread, whichever thread holds the state's sampler_lock.
+ * The hit and miss counts may be read by any thread. Lookups that found no line are cached
+ * too, since most frames in a deep callchain fall outside the source scope. The
+ * cache is emptied when the memory map's generation changes, so misses cached
+ * before a binary's lines were added are not reused. New JIT functions only drop
+ * the cached misses.
+ */
+class line_cache {
+public:
+  enum { Size = 1024 }; //< Number of entries (must be a power of two)
+
+  /// Look up a PC. On a hit, set l to the cached line (possibly null) and return true.
+  inline bool find(uintptr_t pc, line*& l) {
+    const entry& e = _entries[index(pc)];
+    if(e.pc == pc) {
+      l = e.l;
+      _hits.store(_hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return true;
+    }
+    _misses.store(_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return false;
+  }
+
+  /// Empty the cache if lines have been added to the memory map since it was filled,
+  /// or drop only the cached misses if just JIT functions were added
+  inline void sync(size_t generation, size_t jit_generation) {
+    if(generation != _generation) {
+      for(size_t i = 0; i < Size; i++) {
+        _entries[i] = entry();
+      }
+      _generation = generation;
+      _jit_generation = jit_generation;
+    } else if(jit_generation != _jit_generation) {
+      for(size_t i = 0; i < Size; i++) {
+        if(_entries[i].l == nullptr) _entries[i] = entry();
+      }
+      _jit_generation = jit_generation;
+    }
+  }
+
+  /// Record the result of a full lookup for a PC
+  inline void insert(uintptr_t pc, line* l) {
+    entry& e = _entries[index(pc)];
+    e.pc = pc;
+    e.l = l;
+  }
+
+  inline size_t get_hits() const { return _hits.load(std::memory_order_relaxed); }
+  inline size_t get_misses() const { return _misses.load(std::memory_order_relaxed); }
+
+  /// Reset the hit and miss counts
+  inline void clear_stats() {
+    _hits.store(0, std::memory_order_relaxed);
+    _misses.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static inline size_t index(uintptr_t pc) {
+    return (pc ^ (pc >> 12)) & (Size - 1);
+  }
+
+  struct entry {
+    uintptr_t pc;
+    line* l;
+  };
+
+  entry _entries[Size] = {};
+  size_t _generation = 0;           //< Memory map generation the entries came from
+  size_t _jit_generation = 0;       //< JIT generation the cached misses came from
+  std::atomic<size_t> _hits{0};     //< Lookups answered from the cache
+  std::atomic<size_t> _misses{0};   //< Lookups that went to the memory map
+};
+
+/**
+ * Per-thread sample counts for recently sampled lines. Counting here instead of in
+ * each line's shared counter keeps threads sampled in the same hot loop from
+ * contending for one cache line. A slot's count moves to its line's shared counter
+ * when the slot is reused for another line, and when the thread stops sampling.
+ *
+ * One thread at a time writes to a shard, under the same rule as the line cache: the
+ * owning thread, or whichever thread holds the state's sampler_lock when a sample
+ * reader thread is in use. Other threads may read it, and can briefly miss a count
+ * that is being moved to the shared counter.
+ */
+class sample_shard {
+public:
+  enum { Size = 256 }; //< Number of slots (must be a power of two)
+
+  /// Count one sample in a line
+  inline void add(line* l) {
+    entry& e = _entries[index(l)];
+    line* current = e.l.load(std::memory_order_relaxed);
+    if(current != l) {
+      if(current != nullptr) {
+        // Clear the slot before publishing its count so readers can't count it twice
+        size_t n = e.count.load(std::memory_order_relaxed);
+        e.count.store(0);
+        current->add_samples(n);
+      }
+      e.l.store(l);
+    }
+    e.count.store(e.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  /// Get the number of samples for a line held in this shard
+  inline size_t get(const line* l) const {
+    const entry& e = _entries[index(l)];
+    if(e.l.load() == l) {
+      return e.count.load(std::memory_order_relaxed);
+    }
+    return 0;
+  }
+
+  /// Call a function with each line and the number of samples held for it in this shard
+  template<typename F>
+  void for_each(F fn) const {
+    for(size_t i = 0; i < Size; i++) {
+      line* l = _entries[i].l.load();
+      size_t n = _entries[i].count.load(std::memory_order_relaxed);
+      if(l != nullptr && n > 0) {
+        fn(l, n);
+      }
+    }
+  }
+
+  /// Move all counts to the lines' shared counters and empty the shard
+  void flush() {
+    for(size_t i = 0; i < Size; i++) {
+      line* l = _entries[i].l.load(std::memory_order_relaxed);
+      if(l != nullptr) {
+        size_t n = _entries[i].count.load(std::memory_order_relaxed);
+        _entries[i].count.store(0);
+        _entries[i].l.store(nullptr);
+        l->add_samples(n);
+      }
+    }
+  }
+
+  /// Empty the shard without moving its counts anywhere
+  void clear() {
+    for(size_t i = 0; i < Size; i++) {
+      _entries[i].count.store(0);
+      _entries[i].l.store(nullptr);
+    }
+  }
+
+private:
+  static inline size_t index(const line* l) {
+    uintptr_t p = reinterpret_cast<uintptr_t>(l);
+    return ((p >> 3) ^ (p >> 11)) & (Size - 1);
+  }
+
+  struct entry {
+    std::atomic<line*> l{nullptr};
+    std::atomic<size_t> count{0};
+  };
+
+  entry _entries[Size];
+};
+
 class thread_state {
 public:
   bool in_use = false;      //< Set by the main thread to prevent signal handler from racing
   std::atomic<size_t> local_delay{0};   //< The count of delays (or selected line visits) in the thread
   perf_event sampler;       //< The sampler object for this thread
   timer process_timer;      //< The timer that triggers sample processing for this thread
-  size_t pre_block_time;    //< The time saved before (possibly) blocking
+  block_nesting blocking;   //< Possibly blocking calls in progress, and the delay when they began
   std::atomic<bool> is_blocked{false};  //< True between pre_block() and post_block(); skip delays
+  line_cache pc_cache;      //< Recently sampled PCs and their source lines
+  sample_shard samples;     //< This thread's share of the per-line sample counts
+  uint64_t throttle_time = 0;   //< When the kernel throttled this thread's sampler, or 0
+  pid_t tid = 0;            //< Thread that owns this state
+  size_t delay_shard = 0;   //< The global delay counter shard this thread raises the total through
+  spinlock sampler_lock;    //< Held while the sampler is read, replaced or closed, and while
+                            //< pc_cache and samples are used, when a separate thread reads samples
   
   inline void set_in_use(bool value) {
     in_use = value;
@@ -55,7 +55,12 @@ static inline size_t wait(size_t ns) {
   ts.tv_sec = (ns - ts.tv_nsec) / (1000 * 1000 * 1000);
 
   size_t start_time = get_time();
+#if defined(__APPLE__)
   while(nanosleep(&ts, &ts) != 0) {}
+#else
+  // Bypass the nanosleep wrapper, which would treat coz's own pauses as blocking calls
+  while(real::nanosleep(&ts, &ts) != 0) {}
+#endif
 
   return get_time() - start_time;
 }
@@ -76,4 +81,14 @@ static inline std::string getenv_safe(const char* var, const char* fallback = ""
   return std::string(value);
 }
 
+/// Name a process's own output file by adding its PID before the file extension
+static inline std::string get_process_output(const std::string& name, pid_t pid) {
+  size_t dir = name.rfind('/');
+  size_t dot = name.rfind('.');
+  if(dot == std::string::npos || (dir != std::string::npos && dot < dir) || dot == dir + 1) {
+    return name + "." + std::to_string(pid);
+  }
+  return name.substr(0, dot) + "." + std::to_string(pid) + name.substr(dot);
+}
+
 #endif
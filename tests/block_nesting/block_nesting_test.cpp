@@ -0,0 +1,119 @@
+/**
+ * Unit tests for the blocking call bookkeeping in libcoz/block_nesting.h.
+ * Checks that a wait nested inside another, like an OpenMP barrier wait whose
+ * runtime sleeps in pthread_cond_wait, skips the delays added while blocked
+ * only once.
+ */
+
+#include "block_nesting.h"
+#include "delay_counter.h"
+
+#include <cstdio>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+/// A thread's delay bookkeeping, updated the way profiler::pre_block and post_block do
+struct blocked_thread {
+  delay_counter& global;
+  block_nesting blocking;
+  size_t local_delay = 0;
+
+  explicit blocked_thread(delay_counter& g) : global(g) {}
+
+  void pre_block() { blocking.enter(global.load()); }
+
+  void post_block(bool skip_delays) {
+    size_t added;
+    if(blocking.leave(global.load(), added) && skip_delays) local_delay += added;
+  }
+};
+
+TEST(single_wait) {
+  delay_counter global;
+  blocked_thread t(global);
+
+  t.pre_block();
+  ASSERT_TRUE(t.blocking.depth() == 1);
+  global.add(100);
+  t.post_block(true);
+  ASSERT_TRUE(t.blocking.depth() == 0);
+  ASSERT_TRUE(t.local_delay == 100);
+
+  // Delays added during a wait that timed out are paid, not skipped
+  t.pre_block();
+  global.add(50);
+  t.post_block(false);
+  ASSERT_TRUE(t.local_delay == 100);
+}
+
+TEST(nested_waits) {
+  delay_counter global;
+  blocked_thread t(global);
+
+  // An OpenMP barrier wait begins, then the runtime sleeps on a condition variable
+  t.pre_block();
+  global.add(100);
+  t.pre_block();
+  ASSERT_TRUE(t.blocking.depth() == 2);
+  global.add(200);
+  t.post_block(true);
+  ASSERT_TRUE(t.local_delay == 0);
+  global.add(300);
+  t.post_block(true);
+
+  // Every delay added during the outer wait is skipped exactly once
+  ASSERT_TRUE(t.blocking.depth() == 0);
+  ASSERT_TRUE(t.local_delay == 600);
+  ASSERT_TRUE(t.local_delay == global.load());
+
+  // Only the outermost wait decides whether delays are skipped
+  t.pre_block();
+  t.pre_block();
+  global.add(10);
+  t.post_block(true);
+  t.post_block(false);
+  ASSERT_TRUE(t.local_delay == 600);
+}
+
+TEST(unmatched_end) {
+  delay_counter global;
+  blocked_thread t(global);
+
+  // An end with no matching start settles like an outermost call
+  global.add(40);
+  size_t added = 0;
+  ASSERT_TRUE(t.blocking.leave(global.load(), added));
+  ASSERT_TRUE(added == 40);
+  ASSERT_TRUE(t.blocking.depth() == 0);
+  ASSERT_TRUE(t.blocking.enter(global.load()));
+}
+
+int main() {
+  // Tests are run by static initializers above
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
@@ -0,0 +1,169 @@
+/**
+ * Unit tests for the shared experiment state in libcoz/coordinator.h.
+ * Checks that progress point counters and the global delay are shared with a
+ * forked process, that one process at a time coordinates, and that experiments
+ * and line offers pass between attached processes.
+ */
+
+#include "coordinator.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+/// Name the segment for the test process, so forked children find the same one
+static std::string segment_name() {
+  static std::string name = "coz-coordinator-test-" + std::to_string(getpid());
+  return name;
+}
+
+/// Run fn in a forked child that attaches to the segment, and return its exit status
+template<typename F>
+static int in_child(F fn) {
+  pid_t pid = fork();
+  if(pid == 0) {
+    coordinator c;
+    if(!c.attach(segment_name())) _exit(100);
+    int result = fn(c);
+    c.detach();
+    _exit(result);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+TEST(shared_counters) {
+  coordinator c;
+  ASSERT_FALSE(c.is_attached());
+  ASSERT_TRUE(c.attach(segment_name()));
+  ASSERT_TRUE(c.is_attached());
+
+  coz_counter_t* work = c.get_counters(coordinator::ThroughputPoint, "work");
+  coz_counter_t* request = c.get_counters(coordinator::LatencyPoint, "request");
+  ASSERT_TRUE(work != nullptr && request != nullptr);
+  // Points of different kinds never share counters, even with the same name
+  ASSERT_TRUE(c.get_counters(coordinator::LatencyPoint, "work") != work);
+  ASSERT_TRUE(c.get_counters(coordinator::ThroughputPoint, "work") == work);
+
+  work->count = 5;
+  c.get_global_delay().add(1000);
+
+  // Another process sees the same counters and delays, and its updates come back
+  int status = in_child([](coordinator& other) {
+    coz_counter_t* w = other.get_counters(coordinator::ThroughputPoint, "work");
+    if(w == nullptr || w->count != 5) return 1;
+    if(other.get_global_delay().load() != 1000) return 2;
+    __atomic_add_fetch(&w->count, 10, __ATOMIC_RELAXED);
+    other.get_global_delay().add(500);
+    other.get_counters(coordinator::ThroughputPoint, "child-only");
+    return 0;
+  });
+  ASSERT_TRUE(status == 0);
+  ASSERT_TRUE(work->count == 15);
+  ASSERT_TRUE(c.get_global_delay().load_exact() == 1500);
+
+  // A process that exits without detaching leaves its raises behind
+  pid_t pid = fork();
+  if(pid == 0) {
+    coordinator other;
+    if(other.attach(segment_name())) other.get_global_delay().raise_to(3, 4000);
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+  ASSERT_TRUE(c.get_global_delay().load() == 4000);
+  ASSERT_TRUE(c.get_global_delay().refresh() == 4000);
+
+  size_t points = 0;
+  bool found_child_point = false;
+  c.for_each_point([&](coordinator::point_kind kind, const std::string& name) {
+    points++;
+    if(kind == coordinator::ThroughputPoint && name == "child-only") found_child_point = true;
+  });
+  ASSERT_TRUE(points == 4);
+  ASSERT_TRUE(found_child_point);
+
+  // Names that do not fit in the segment are not shared
+  ASSERT_TRUE(c.get_counters(coordinator::ThroughputPoint, std::string(coordinator::MaxName, 'x')) == nullptr);
+
+  c.detach();
+}
+
+TEST(coordination) {
+  coordinator c;
+  ASSERT_TRUE(c.attach(segment_name()));
+  ASSERT_TRUE(c.try_coordinate(getpid()));
+  ASSERT_TRUE(c.try_coordinate(getpid()));
+
+  // A live coordinator keeps its role; the child takes it over after a resignation
+  ASSERT_TRUE(in_child([](coordinator& other) { return other.try_coordinate(getpid()) ? 1 : 0; }) == 0);
+
+  c.begin_experiment("main.cpp:12", 250);
+  int status = in_child([](coordinator& other) {
+    uint64_t id;
+    std::string line;
+    size_t delay_size;
+    if(!other.get_experiment(id, line, delay_size)) return 1;
+    if(line != "main.cpp:12" || delay_size != 250 || id == 0) return 2;
+    other.count_selected_sample();
+    other.propose_line("worker.cpp:40");
+    return 0;
+  });
+  ASSERT_TRUE(status == 0);
+  ASSERT_TRUE(c.get_selected_samples() == 1);
+
+  std::string offered;
+  ASSERT_TRUE(c.take_proposal(offered));
+  ASSERT_TRUE(offered == "worker.cpp:40");
+  ASSERT_FALSE(c.take_proposal(offered));
+
+  c.end_experiment();
+  uint64_t id;
+  std::string line;
+  size_t delay_size;
+  ASSERT_FALSE(c.get_experiment(id, line, delay_size));
+
+  c.resign(getpid());
+  ASSERT_TRUE(in_child([](coordinator& other) { return other.try_coordinate(getpid()) ? 0 : 1; }) == 0);
+
+  // The child exited without resigning, so this process can take its role back
+  ASSERT_TRUE(c.try_coordinate(getpid()));
+  c.detach();
+}
+
+int main() {
+  // Tests are run by static initializers above
+  // A child exited without detaching, so the segment is still counted as in use
+  shm_unlink(segment_name().c_str());
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * Unit tests for the sharded global delay counter in libcoz/delay_counter.h.
+ * Checks that raises are published at once, that additions from many threads all
+ * reach the published total, and that the published total never decreases while
+ * threads are adding.
+ */
+
+#include "delay_counter.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstdio>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+TEST(single_thread) {
+  delay_counter c;
+  ASSERT_TRUE(c.load() == 0);
+  c.set_shards(5);
+  ASSERT_TRUE(c.get_shards() == 8);
+  c.set_shards(2);
+  ASSERT_TRUE(c.get_shards() == 8);
+
+  c.add(100);
+  c.add(50);
+  ASSERT_TRUE(c.load() == 150);
+  ASSERT_TRUE(c.load_exact() == 150);
+
+  // Raising to a lower target adds nothing
+  c.raise_to(0, 120);
+  ASSERT_TRUE(c.load() == 150);
+  c.raise_to(1, 200);
+  ASSERT_TRUE(c.load() == 200);
+  ASSERT_TRUE(c.load_exact() == 200);
+  ASSERT_TRUE(c.refresh() == 200);
+
+  // Additions count from the exact total, and are published at once
+  c.raise_to(9, 300);
+  c.add(10);
+  ASSERT_TRUE(c.load() == 310);
+}
+
+enum { Threads = 8, Adds = 100000 };
+
+static delay_counter shared;
+static std::atomic<bool> adding{true};
+static std::atomic<bool> decreased{false};
+
+static void* adder(void*) {
+  for(size_t i = 0; i < Adds; i++) {
+    shared.add(3);
+  }
+  return nullptr;
+}
+
+static void* watcher(void*) {
+  size_t last = 0;
+  while(adding.load()) {
+    size_t now = shared.refresh();
+    if(now < last) decreased = true;
+    last = now;
+  }
+  return nullptr;
+}
+
+TEST(concurrent_adds) {
+  shared.set_shards(4);
+  pthread_t watch;
+  pthread_create(&watch, nullptr, watcher, nullptr);
+
+  pthread_t threads[Threads];
+  for(size_t i = 0; i < Threads; i++) {
+    pthread_create(&threads[i], nullptr, adder, nullptr);
+  }
+  for(size_t i = 0; i < Threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  adding = false;
+  pthread_join(watch, nullptr);
+
+  // Every addition is published once all adders have returned
+  ASSERT_TRUE(shared.load_exact() == 3 * Threads * Adds);
+  ASSERT_TRUE(shared.load() == 3 * Threads * Adds);
+  ASSERT_FALSE(decreased.load());
+}
+
+int main() {
+  // Tests are run by static initializers above
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
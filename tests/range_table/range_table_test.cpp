@@ -0,0 +1,128 @@
+/**
+ * Unit tests for the flat address range table in libcoz/range_table.h.
+ * Verifies that lookups agree with a straightforward linear search for
+ * addresses inside ranges, in gaps, and outside the table entirely.
+ */
+
+#include "range_table.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+struct span {
+  uintptr_t base;
+  uintptr_t limit;
+  int value;
+};
+
+// Reference lookup: scan every range
+static const int* linear_find(const std::vector<span>& spans, uintptr_t addr) {
+  for(const span& s : spans) {
+    if(s.base <= addr && addr < s.limit)
+      return &s.value;
+  }
+  return nullptr;
+}
+
+static void build(range_table<const int>& t, const std::vector<span>& spans) {
+  t.clear();
+  for(const span& s : spans) {
+    t.add(s.base, s.limit, &s.value);
+  }
+  t.freeze();
+}
+
+TEST(empty_table) {
+  range_table<const int> t;
+  t.freeze();
+  ASSERT_TRUE(t.empty());
+  ASSERT_TRUE(t.find(0) == nullptr);
+  ASSERT_TRUE(t.find(0x1000) == nullptr);
+  ASSERT_TRUE(t.find(UINTPTR_MAX) == nullptr);
+}
+
+TEST(single_range) {
+  std::vector<span> spans = {{0x1000, 0x1010, 1}};
+  range_table<const int> t;
+  build(t, spans);
+  ASSERT_TRUE(t.find(0xfff) == nullptr);
+  ASSERT_TRUE(t.find(0x1000) == &spans[0].value);
+  ASSERT_TRUE(t.find(0x100f) == &spans[0].value);
+  ASSERT_TRUE(t.find(0x1010) == nullptr);
+}
+
+TEST(adjacent_ranges_and_gaps) {
+  std::vector<span> spans = {
+    {0x1000, 0x1010, 1},
+    {0x1010, 0x1020, 2},  // Adjacent to the previous range
+    {0x1040, 0x1050, 3},  // Preceded by a gap
+  };
+  range_table<const int> t;
+  build(t, spans);
+  ASSERT_TRUE(t.find(0x100f) == &spans[0].value);
+  ASSERT_TRUE(t.find(0x1010) == &spans[1].value);
+  ASSERT_TRUE(t.find(0x1020) == nullptr);
+  ASSERT_TRUE(t.find(0x103f) == nullptr);
+  ASSERT_TRUE(t.find(0x1040) == &spans[2].value);
+  ASSERT_TRUE(t.find(0x1050) == nullptr);
+}
+
+TEST(matches_linear_search) {
+  // Try every table size up to a few complete tree levels, so both full and
+  // partial bottom levels of the Eytzinger layout are covered
+  std::mt19937_64 rng(42);
+  for(size_t n = 1; n <= 70; n++) {
+    std::vector<span> spans;
+    uintptr_t p = 0x400000;
+    for(size_t i = 0; i < n; i++) {
+      p += rng() % 4;           // Optional gap before each range
+      uintptr_t len = 1 + rng() % 8;
+      spans.push_back(span{p, p + len, static_cast<int>(i)});
+      p += len;
+    }
+
+    range_table<const int> t;
+    build(t, spans);
+
+    bool all_match = true;
+    for(uintptr_t addr = 0x400000 - 2; addr <= p + 2; addr++) {
+      if(t.find(addr) != linear_find(spans, addr))
+        all_match = false;
+    }
+    ASSERT_TRUE(all_match);
+  }
+}
+
+int main() {
+  // Tests are run by static initializers above
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
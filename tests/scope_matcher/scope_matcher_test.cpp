@@ -0,0 +1,132 @@
+/**
+ * Unit tests for the compiled scope patterns in libcoz/scope_matcher.h.
+ * Verifies that matches agree with the recursive wildcard matcher coz used
+ * before patterns were compiled, including its edge cases around wildcards
+ * at the end of the subject.
+ */
+
+#include "scope_matcher.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+// Reference matcher: the original backtracking implementation
+static bool wildcard_match(std::string::const_iterator subject,
+                           std::string::const_iterator subject_end,
+                           std::string::const_iterator pattern,
+                           std::string::const_iterator pattern_end) {
+  if((pattern == pattern_end) != (subject == subject_end)) {
+    return false;
+  } else if(pattern == pattern_end && subject == subject_end) {
+    return true;
+  } else if(*pattern == '%') {
+    for(auto match_end = subject_end; match_end >= subject; match_end--) {
+      if(wildcard_match(match_end, subject_end, pattern + 1, pattern_end))
+        return true;
+    }
+    return false;
+  } else {
+    while(subject != subject_end && pattern != pattern_end && *pattern != '%') {
+      if(*pattern != *subject)
+        return false;
+      pattern++;
+      subject++;
+    }
+    return wildcard_match(subject, subject_end, pattern, pattern_end);
+  }
+}
+
+static bool single(const std::string& pattern, const std::string& subject) {
+  scope_matcher m;
+  m.add(pattern);
+  return m.matches(subject);
+}
+
+TEST(literal_patterns) {
+  ASSERT_TRUE(single("/src/main.cpp", "/src/main.cpp"));
+  ASSERT_FALSE(single("/src/main.cpp", "/src/main.cc"));
+  ASSERT_FALSE(single("/src/main.cpp", "/src/main.cpp.o"));
+}
+
+TEST(wildcards) {
+  ASSERT_TRUE(single("%", "/any/path.c"));
+  ASSERT_TRUE(single("/home/%/src/%.cpp", "/home/user/src/lib/a.cpp"));
+  ASSERT_TRUE(single("%/include/%", "/usr/include/stdio.h"));
+  ASSERT_FALSE(single("%/include/%", "/usr/lib/libc.so"));
+  ASSERT_TRUE(single("a%b%b", "abbb"));
+  ASSERT_FALSE(single("a%b%b", "ab"));
+}
+
+TEST(wildcard_at_end_of_subject) {
+  // A wildcard never matches starting at the end of the subject
+  ASSERT_FALSE(single("%", ""));
+  ASSERT_FALSE(single("/src/%", "/src/"));
+  ASSERT_FALSE(single("a%%", "a"));
+  ASSERT_TRUE(single("a%%", "ab"));
+}
+
+TEST(pattern_sets) {
+  scope_matcher m;
+  ASSERT_TRUE(m.empty());
+  m.add("/usr/lib/%");
+  m.add("%/app/%.c");
+  ASSERT_TRUE(m.size() == 2);
+  ASSERT_TRUE(m.matches("/usr/lib/libm.so"));
+  ASSERT_TRUE(m.matches("/build/app/x.c"));
+  ASSERT_FALSE(m.matches("/build/app/x.h"));
+}
+
+TEST(matches_reference) {
+  // Random patterns and subjects over a tiny alphabet, so literal parts overlap often
+  std::mt19937 rng(7);
+  const char alphabet[] = "ab/%";
+  bool all_match = true;
+  for(int i = 0; i < 200000; i++) {
+    std::string pattern, subject;
+    size_t pattern_len = rng() % 7;
+    size_t subject_len = rng() % 8;
+    for(size_t j = 0; j < pattern_len; j++) pattern += alphabet[rng() % 4];
+    for(size_t j = 0; j < subject_len; j++) subject += alphabet[rng() % 3];
+
+    bool expected = wildcard_match(subject.begin(), subject.end(), pattern.begin(), pattern.end());
+    if(single(pattern, subject) != expected) {
+      fprintf(stderr, "Mismatch: pattern \"%s\" subject \"%s\"\n", pattern.c_str(), subject.c_str());
+      all_match = false;
+      break;
+    }
+  }
+  ASSERT_TRUE(all_match);
+}
+
+int main() {
+  // Tests are run by static initializers above
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
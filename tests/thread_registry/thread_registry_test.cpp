@@ -0,0 +1,152 @@
+/**
+ * Unit tests for the growable thread registry in libcoz/ccutil/thread_registry.h.
+ * Covers lookups, slot reuse, key ranges well beyond the old fixed-size map, and
+ * concurrent registration from many threads.
+ */
+
+#include "ccutil/thread_registry.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+static int tests_run = 0;
+static int tests_passed = 0;
+
+#define TEST(name) \
+  static void test_##name(); \
+  static struct Register_##name { \
+    Register_##name() { test_##name(); } \
+  } register_##name; \
+  static void test_##name()
+
+#define ASSERT_TRUE(expr) do { \
+  tests_run++; \
+  if(!(expr)) { \
+    fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #expr); \
+  } else { \
+    tests_passed++; \
+  } \
+} while(0)
+
+#define ASSERT_FALSE(expr) ASSERT_TRUE(!(expr))
+
+struct value {
+  int data = 0;
+};
+
+typedef thread_registry<int, value> registry;
+
+static size_t count_entries(registry& r) {
+  size_t n = 0;
+  r.for_each([&n](int, value*) { n++; });
+  return n;
+}
+
+TEST(insert_find_remove) {
+  registry r;
+  ASSERT_TRUE(r.find(42) == nullptr);
+
+  value* v = r.insert(42);
+  ASSERT_TRUE(v != nullptr);
+  v->data = 7;
+  ASSERT_TRUE(r.find(42) == v);
+  ASSERT_TRUE(r.find(43) == nullptr);
+  ASSERT_TRUE(count_entries(r) == 1);
+
+  r.remove(42);
+  ASSERT_TRUE(r.find(42) == nullptr);
+  ASSERT_TRUE(count_entries(r) == 0);
+
+  // The freed slot is reused, and its value is left as it was
+  value* reused = r.insert(99);
+  ASSERT_TRUE(reused == v);
+  ASSERT_TRUE(reused->data == 7);
+}
+
+TEST(reinsert_without_remove) {
+  registry r;
+  value* first = r.insert(5);
+  value* second = r.insert(5);
+  ASSERT_TRUE(first != second);
+  ASSERT_TRUE(r.find(5) == second);
+  ASSERT_TRUE(count_entries(r) == 1);
+}
+
+TEST(many_keys) {
+  // More keys than the old 4096-slot map held, both dense and spread over 32 bits
+  registry r;
+  std::vector<int> keys;
+  for(int i = 0; i < 20000; i++) keys.push_back(100000 + i);
+  for(int i = 0; i < 1000; i++) keys.push_back(0x7fff0000 + i * 65);
+
+  bool all_found = true;
+  std::set<value*> values;
+  for(int k : keys) {
+    value* v = r.insert(k);
+    if(v == nullptr) all_found = false;
+    values.insert(v);
+  }
+  for(int k : keys) {
+    if(r.find(k) == nullptr) all_found = false;
+  }
+  ASSERT_TRUE(all_found);
+  ASSERT_TRUE(values.size() == keys.size());
+  ASSERT_TRUE(count_entries(r) == keys.size());
+
+  for(size_t i = 0; i < keys.size(); i += 2) r.remove(keys[i]);
+  ASSERT_TRUE(count_entries(r) == keys.size() / 2);
+  ASSERT_TRUE(r.find(keys[0]) == nullptr);
+  ASSERT_TRUE(r.find(keys[1]) != nullptr);
+}
+
+enum { Threads = 8, Rounds = 20000 };
+
+static registry shared;
+static std::atomic<bool> failed{false};
+
+static void* churn(void* arg) {
+  int base = static_cast<int>(reinterpret_cast<intptr_t>(arg)) * Rounds + 1;
+  for(int i = 0; i < Rounds; i++) {
+    int key = base + i;
+    value* v = shared.insert(key);
+    if(v == nullptr) { failed = true; continue; }
+    v->data = key;
+    if(shared.find(key) != v || v->data != key) failed = true;
+    // Keep every tenth key so some entries survive
+    if(i % 10 != 0) shared.remove(key);
+  }
+  return nullptr;
+}
+
+TEST(concurrent_churn) {
+  pthread_t threads[Threads];
+  for(intptr_t i = 0; i < Threads; i++) {
+    pthread_create(&threads[i], nullptr, churn, reinterpret_cast<void*>(i));
+  }
+  for(int i = 0; i < Threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  ASSERT_FALSE(failed.load());
+  ASSERT_TRUE(count_entries(shared) == Threads * Rounds / 10);
+
+  bool all_kept = true;
+  shared.for_each([&all_kept](int key, value* v) {
+    if((key - 1) % Rounds % 10 != 0 || shared.find(key) != v) all_kept = false;
+  });
+  ASSERT_TRUE(all_kept);
+}
+
+int main() {
+  // Tests are run by static initializers above
+  printf("%d/%d tests passed\n", tests_passed, tests_run);
+  if(tests_passed != tests_run) {
+    printf("SOME TESTS FAILED\n");
+    return 1;
+  }
+  printf("ALL TESTS PASSED\n");
+  return 0;
+}
@@ -900,6 +900,9 @@ class Profile {
             else if (entry.type === 'runtime') {
                 // Do nothing
             }
+            else if (entry.type === 'line-cache') {
+                // Do nothing
+            }
             else if (entry.type === 'experiment') {
                 // Skip experiments targeting coz.h instrumentation overhead
                 if (entry.selected && entry.selected.indexOf('/coz.h:') !== -1) {
@@ -54,7 +54,7 @@ interface LatencyPoint {
 }
 
 interface IgnoredRecord {
-  type: 'startup' | 'shutdown' | 'samples' | 'runtime';
+  type: 'startup' | 'shutdown' | 'samples' | 'runtime' | 'line-cache';
 }
 
 // Minimum number of progress point visits for a data point to be reliable.
@@ -1016,6 +1016,8 @@ class Profile {
         // Do nothing
       } else if (entry.type === 'runtime') {
         // Do nothing
+      } else if (entry.type === 'line-cache') {
+        // Do nothing
       } else if (entry.type === 'experiment') {
         // Skip experiments targeting coz.h instrumentation overhead
         if ((<Experiment>entry).selected && (<Experiment>entry).selected.indexOf('/coz.h:') !== -1) {